@@ -78,7 +78,7 @@ int main(int argc, char *argv[]) {
     } else {
 #ifdef REGEN_ENABLE_PARALLEL
       compile_time -= rdtsc();
-      regen::Regex r = regen::Regex(regex);
+      regen::Regex r(regex);
       r.Compile(Regen::Options::O0);
       regen::SFA sfa(r.dfa(), thread_num);
       sfa.Compile(olevel);
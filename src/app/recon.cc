@@ -144,6 +144,7 @@ void die(bool help = false)
            "  -f   obtain PATTERN from FILE\n"
            "Output control:\n"
            "  -t   generate acceptable strings\n"
+           "  -c   generate a C matcher: int match(const char *str, size_t len)\n"
            "  -d   generate DFA graph (Dot language)\n"
            "  -s   generate SFA graph (Dot language)\n"
            "  -k   extract keywords"
@@ -239,7 +240,7 @@ int main(int argc, char *argv[]) {
     return 0;
   }
 
-  regen::Regex r = regen::Regex(regex, option);
+  regen::Regex r(regex, option);
 
   if (info) {
     printf("%"PRIuS" chars involved. min length = %"PRIuS", max length = %"PRIuS"\n", r.expr_info().involve.count(), r.min_length(), r.max_length());
@@ -12,11 +12,12 @@ struct Option {
   Regen::Options::CompileFlag olevel;
 };
 
-void grep(const Regen &re, const regen::Util::mmap_t &buf, const Option &opt);
+int grep(const Regen &re, const Regen::StringPiece &buf, const Option &opt);
+int grep_stream(const Regen &re, int fd, const Option &opt);
 
 const char* get_line_beg(const char* buf, const char *beg)
 {
-  while (buf > beg && *buf != '\n') buf--;
+  while (buf > beg && buf[-1] != '\n') buf--;
   return buf;
 }
 
@@ -68,13 +69,11 @@ int main(int argc, char *argv[])
   }
   
   if (regex.empty()) {
-    if (optind+1 >= argc) {
-      exitmsg("USAGE: regen [options] regexp file\n");
+    if (optind >= argc) {
+      exitmsg("USAGE: regen [options] regexp [file...]\n");
     } else {
       regex = std::string(argv[optind++]);
     }
-  } else if (optind >= argc) {
-    exitmsg("USAGE: regen [options] regexp file\n");
   }
 
   Regen re(regex, opt.pflag);
@@ -82,18 +81,50 @@ int main(int argc, char *argv[])
 
   if (optind < argc+1 && opt.print_file != -1) opt.print_file = 1;
   
+  if (optind == argc) {
+    /* no file: read standard input, e.g. from a pipe */
+    int count = grep_stream(re, 0, opt);
+    if (opt.count_line) printf("%d\n", count);
+  }
   for (int i = optind; i < argc; i++) {
     opt.filename = argv[optind];
-    regen::Util::mmap_t buf(opt.filename);
-    grep(re, buf, opt);
+    int count;
+    if (strcmp(opt.filename, "-") == 0) {
+      count = grep_stream(re, 0, opt);
+    } else {
+      regen::Util::mmap_t buf(opt.filename);
+      count = grep(re, Regen::StringPiece(buf.ptr, buf.size), opt);
+    }
+    if (opt.count_line) printf("%d\n", count);
   }
 
   return 0;
 }
 
-void grep(const Regen &re, const regen::Util::mmap_t &buf, const Option &opt)
+/* input which can not be mapped is read in blocks. each block is matched
+ * up to its last newline, the partial line is kept for the next one. */
+int grep_stream(const Regen &re, int fd, const Option &opt)
+{
+  static const std::size_t BlockSize = 1 << 20;
+  std::string buf;
+  int count = 0;
+  ssize_t n;
+  do {
+    std::size_t size = buf.size();
+    buf.resize(size + BlockSize);
+    n = read(fd, &buf[size], BlockSize);
+    if (n < 0) exitmsg("read error\n");
+    buf.resize(size + n);
+    std::size_t lines = n == 0 ? buf.size() : buf.rfind('\n', buf.size()) + 1;
+    if (lines > 0) count += grep(re, Regen::StringPiece(buf.data(), lines), opt);
+    buf.erase(0, lines);
+  } while (n > 0);
+  return count;
+}
+
+int grep(const Regen &re, const Regen::StringPiece &buf, const Option &opt)
 {
-  Regen::StringPiece string(buf.ptr, buf.size), result;
+  Regen::StringPiece string(buf), result;
   static const char newline[] = "\n";
   int count = 0;
   while (re.Match(string, &result)) {
@@ -106,18 +137,20 @@ void grep(const Regen &re, const regen::Util::mmap_t &buf, const Option &opt)
         string.set_begin(result.end());
       }
     } else {
-      const char *end = (const char*)memchr(result.end(), '\n', string.end()-result.end());
+      /* the last byte of the match is in the line or is its newline */
+      const char *last = result.end() == string.begin() ? result.end() : result.end() - 1;
+      const char *end = (const char*)memchr(last, '\n', string.end()-last);
       if (end == NULL) end = string.end();
       if (opt.count_line) {
         count++;
       } else {
-        const char *beg = get_line_beg(result.end(), string.begin());
-        if (*beg == '\n') beg++;
-        write(1, beg, end-beg+1);
+        const char *beg = get_line_beg(last, string.begin());
+        write(1, beg, end-beg);
+        write(1, newline, 1);
       }
       string.set_begin(end+1);
     }
     if (string.empty()) break;
   }
-  if (opt.count_line) printf("%d\n", count);
+  return count;
 }
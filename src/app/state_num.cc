@@ -45,7 +45,7 @@ int main(int argc, char *argv[]) {
 
   Regen::Options option;
   option.extended(E);
-  regen::Regex r = regen::Regex(regex, option);
+  regen::Regex r(regex, option);
 
   if (n) {
     printf("NFA state num:  %"PRIuS"\n", r.state_exprs().size());
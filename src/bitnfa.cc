@@ -0,0 +1,306 @@
+#include "bitnfa.h"
+
+namespace regen {
+
+namespace {
+
+/* numbers the positions, the clones of a counted position (see Counter)
+ * all with one number, that of its last clone: its follow set is where
+ * the threads leave to. */
+struct Numbering {
+  typedef std::pair<std::size_t, std::size_t> Clone;
+  static const std::size_t npos = static_cast<std::size_t>(-1);
+  Numbering(const std::vector<Counter> &counters, StateExpr *prefix):
+      counters_(counters), counter_ids_(counters.size(), npos), prefix_(prefix)
+  {
+    for (std::size_t k = 0; k < counters.size(); k++) {
+      for (std::size_t j = 0; j < counters[k].positions.size(); j++) {
+        clones_[counters[k].positions[j]] = Clone(k, j);
+      }
+    }
+  }
+  std::size_t Id(StateExpr *s)
+  {
+    std::map<StateExpr*, Clone>::iterator clone = clones_.find(s);
+    if (clone != clones_.end()) {
+      std::size_t &id = counter_ids_[clone->second.first];
+      if (id == npos) {
+        id = positions.size();
+        positions.push_back(counters_[clone->second.first].positions.back());
+        counters.push_back(&counters_[clone->second.first]);
+      }
+      return id;
+    }
+    std::map<StateExpr*, std::size_t>::iterator iter = ids_.find(s);
+    if (iter != ids_.end()) return iter->second;
+    ids_[s] = positions.size();
+    positions.push_back(s);
+    counters.push_back(NULL);
+    return positions.size() - 1;
+  }
+  /* the numbers of the positions of `set', but the clones of `counter'
+   * after the index-th (which only count). false if it goes into some
+   * counted position past its first clone, which the counts cannot
+   * tell apart from it. */
+  bool Bits(std::set<StateExpr*> &set, const Counter *counter, std::size_t index, BitNFA::word_t *bits)
+  {
+    *bits = 0;
+    for (std::set<StateExpr*>::iterator iter = set.begin(); iter != set.end(); ++iter) {
+      if (*iter == prefix_) continue;
+      std::map<StateExpr*, Clone>::iterator clone = clones_.find(*iter);
+      if (clone != clones_.end()) {
+        const Counter &c = counters_[clone->second.first];
+        if (&c == counter && clone->second.second > index) continue;
+        if (clone->second.second > 0 && set.find(c.positions[0]) == set.end()) return false;
+      }
+      const std::size_t id = Id(*iter);
+      if (id >= BitNFA::MaxPositions) return false;
+      *bits |= (BitNFA::word_t)1 << id;
+    }
+    return true;
+  }
+  std::vector<StateExpr*> positions;
+  std::vector<const Counter*> counters;
+ private:
+  const std::vector<Counter> &counters_;
+  std::vector<std::size_t> counter_ids_;
+  StateExpr *prefix_;
+  std::map<StateExpr*, std::size_t> ids_;
+  std::map<StateExpr*, Clone> clones_;
+};
+
+} // namespace
+
+/* the counts of the threads in the counted positions, kept as the bytes
+ * where they entered, the oldest first. a byte either adds one to all
+ * the counts of a position or ends all its threads, so each is a queue,
+ * of at most `upper' threads, in a ring buffer of `buffer'. */
+class BitNFA::Counts {
+public:
+  Counts(const std::vector<CountedPosition> &counters, std::size_t *buffer):
+      counters_(counters), head_(buffer), size_(buffer + counters.size()), entered_(buffer + 2 * counters.size())
+  {
+    std::fill(head_, entered_, 0);
+  }
+  static std::size_t buffer_size(const std::vector<CountedPosition> &counters)
+  {
+    if (counters.empty()) return 0;
+    return 2 * counters.size() + counters.back().base + counters.back().upper;
+  }
+  /* threads entering the positions at the byte `offset', and the
+   * positions with threads. */
+  word_t Enter(word_t positions, std::size_t offset)
+  {
+    for (std::size_t k = 0; k < counters_.size(); k++) {
+      const word_t bit = counters_[k].bit;
+      if (positions & bit) Push(k, offset);
+      if (size_[k] == 0) {
+        positions &= ~bit;
+      } else {
+        positions |= bit;
+      }
+    }
+    return positions;
+  }
+  /* the byte at `offset' matched by `matched' of the `active' positions
+   * (`fresh' ones entering at it). the matched counted positions are
+   * kept if some thread may leave them. */
+  word_t Read(word_t active, word_t matched, word_t fresh, std::size_t offset)
+  {
+    for (std::size_t k = 0; k < counters_.size(); k++) {
+      const CountedPosition &counter = counters_[k];
+      if (!(active & counter.bit)) continue;
+      if (!(matched & counter.bit)) {
+        size_[k] = 0;
+        continue;
+      }
+      if (fresh & counter.bit) Push(k, offset);
+      if (size_[k] == 0 || offset + 1 - Front(k) < counter.lower) matched &= ~counter.bit;
+      /* drop the threads at `upper', which may not read any more. */
+      while (size_[k] != 0 && offset + 2 - Front(k) > counter.upper) Pop(k);
+    }
+    return matched;
+  }
+private:
+  std::size_t Front(std::size_t k) const { return entered_[counters_[k].base + head_[k]]; }
+  void Push(std::size_t k, std::size_t offset)
+  {
+    const std::size_t upper = counters_[k].upper, base = counters_[k].base;
+    if (size_[k] != 0 && entered_[base + (head_[k] + size_[k] - 1) % upper] == offset) return;
+    entered_[base + (head_[k] + size_[k]) % upper] = offset;
+    size_[k]++;
+  }
+  void Pop(std::size_t k)
+  {
+    head_[k] = (head_[k] + 1) % counters_[k].upper;
+    size_[k]--;
+  }
+  const std::vector<CountedPosition> &counters_;
+  std::size_t *head_, *size_, *entered_;
+};
+
+BitNFA::BitNFA(const ExprInfo &expr_info, const Regen::Options &flag):
+    ok_(false), flag_(flag), size_(0), first_(0), accept_(0), prefix_(false), counted_(0)
+{
+  std::fill(mask_, mask_ + 256, 0);
+  if (expr_info.expr_root == NULL || expr_info.pattern_num != 0
+      || flag_.reverse_match() || flag_.reverse_regex()) return;
+
+  /* number the positions reachable from the start, except the `.*?'. */
+  Dot *prefix = NULL;
+  std::set<StateExpr*> &first = expr_info.expr_root->transition().first;
+  for (std::set<StateExpr*>::iterator iter = first.begin(); iter != first.end(); ++iter) {
+    if (!flag_.prefix_match() && (*iter)->root_non_greedy() && (*iter)->type() == Expr::kDot) {
+      prefix = static_cast<Dot*>(*iter);
+    }
+  }
+  Numbering numbering(expr_info.counters, prefix);
+  std::vector<StateExpr*> &positions = numbering.positions;
+  for (std::set<StateExpr*>::iterator iter = first.begin(); iter != first.end(); ++iter) {
+    if (*iter != prefix) numbering.Id(*iter);
+  }
+  for (std::size_t i = 0; i < positions.size(); i++) {
+    StateExpr *s = positions[i];
+    switch (s->type()) {
+      case Expr::kLiteral: case Expr::kCharClass: case Expr::kDot: case Expr::kEOP: break;
+      default: return;
+    }
+    if (s->non_greedy() || positions.size() > MaxPositions) return;
+    for (std::set<StateExpr*>::iterator iter = s->follow().begin(); iter != s->follow().end(); ++iter) {
+      if (*iter == prefix) return;
+      numbering.Id(*iter);
+    }
+  }
+  if (positions.size() > MaxPositions) return;
+  size_ = positions.size();
+
+  if (!numbering.Bits(first, NULL, 0, &first_)) return;
+  std::vector<word_t> follow(size_, 0);
+  std::size_t counted_base = 0;
+  for (std::size_t i = 0; i < size_; i++) {
+    const word_t bit = (word_t)1 << i;
+    StateExpr *s = positions[i];
+    const Counter *counter = numbering.counters[i];
+    if (s->type() == Expr::kEOP) accept_ |= bit;
+    if (!numbering.Bits(s->follow(), counter, counter == NULL ? 0 : counter->upper - 1, &follow[i])) return;
+    if (counter != NULL) {
+      /* the clones are expanded as X{n}(X?){m-n}: each but the last goes
+       * on to the next, and after the n-th also where the last does. */
+      const std::vector<StateExpr*> &clones = counter->positions;
+      const std::size_t lower = std::max(counter->lower, (std::size_t)1);
+      if (clones.size() != counter->upper) return;
+      for (std::size_t j = 0; j + 1 < clones.size(); j++) {
+        std::set<StateExpr*> &next = clones[j]->follow();
+        word_t leave;
+        if (clones[j]->non_greedy() || next.find(clones[j+1]) == next.end()) return;
+        if (j + 1 < lower) {
+          if (next.size() != 1) return;
+        } else if (!numbering.Bits(next, counter, j, &leave) || leave != follow[i]) {
+          return;
+        }
+      }
+      CountedPosition counted = { bit, lower, counter->upper, counted_base };
+      counted_base += counter->upper;
+      counters_.push_back(counted);
+      counted_ |= bit;
+    }
+    /* same as DFA::FillTransition */
+    for (std::size_t c = 0; c < 256; c++) {
+      const bool delimiter = c == flag_.delimiter() && !flag_.one_line();
+      bool match;
+      switch (s->type()) {
+        case Expr::kDot: match = !delimiter || static_cast<Dot*>(s)->match_delimiter(); break;
+        case Expr::kEOP: match = false; break;
+        default:         match = !delimiter && s->Match(c); break;
+      }
+      if (match) mask_[c] |= bit;
+    }
+  }
+  if (positions.size() != size_) return;
+  if (prefix != NULL) {
+    prefix_ = true;
+    for (std::size_t c = 0; c < 256; c++) {
+      const bool delimiter = c == flag_.delimiter() && !flag_.one_line();
+      prefix_follow_[c] = !delimiter || prefix->match_delimiter();
+    }
+  }
+
+  const std::size_t chunk_num = (size_ + 7) / 8;
+  follow_.assign(chunk_num * 256, 0);
+  for (std::size_t k = 0; k < chunk_num; k++) {
+    for (std::size_t v = 0; v < 256; v++) {
+      for (std::size_t j = 0; j < 8 && k * 8 + j < size_; j++) {
+        if (v & (1 << j)) follow_[k * 256 + v] |= follow[k * 8 + j];
+      }
+    }
+  }
+  counts_.resize(Counts::buffer_size(counters_));
+  ok_ = true;
+}
+
+std::size_t BitNFA::memory_size() const
+{
+  return sizeof(*this) + follow_.size() * sizeof(word_t)
+      + counters_.size() * sizeof(CountedPosition) + counts_.size() * sizeof(std::size_t);
+}
+
+/* the loop of DFA::OnTheFlyMatch, on sets of positions. `fresh' are the
+ * first positions added by the `.*?', which a match drops. */
+bool BitNFA::Match(const Regen::StringPiece &string, Regen::StringPiece *result) const
+{
+  const unsigned char *begin = string.ubegin(), *str = begin, *end = string.uend();
+  const bool track = !flag_.suffix_match();
+  std::vector<std::size_t> own;
+  std::size_t *buffer = counts_.empty() ? NULL : &counts_[0];
+#ifdef REGEN_ENABLE_PARALLEL
+  boost::mutex::scoped_lock lock(counts_mutex_, boost::defer_lock);
+  if (buffer != NULL && !lock.try_lock()) {
+    own.resize(counts_.size());
+    buffer = &own[0];
+  }
+#endif
+  Counts counts(counters_, buffer);
+  word_t state = first_, fresh = 0;
+  if (counted_ != 0) state = counts.Enter(state, 0);
+  bool prefix = prefix_ && !(state & accept_);
+  const unsigned char *matchptr = track && (state & accept_) ? str : NULL;
+  if (matchptr != NULL && flag_.shortest_match()) end = str;
+
+  while (str != end) {
+    const unsigned char c = *str;
+    const word_t active = state | fresh;
+    word_t matched = active & mask_[c];
+    if (active & counted_) matched = counts.Read(active, matched, fresh, str - begin);
+    state = Follow(matched);
+    if (counted_ != 0) state = counts.Enter(state, str - begin + 1);
+    if (prefix && prefix_follow_[c]) {
+      fresh = first_;
+    } else {
+      fresh = 0;
+      prefix = false;
+      if (state == 0) break;
+    }
+    str++;
+    if ((state | fresh) & accept_) {
+      state |= fresh & accept_;
+      fresh = 0;
+      prefix = false;
+      if (track) {
+        matchptr = str;
+        if (flag_.shortest_match()) break;
+      }
+    }
+  }
+
+  const bool accept = (state | fresh) & accept_;
+  if (result != NULL) {
+    if (accept && (flag_.suffix_match() || matchptr == NULL)) {
+      result->set_end(string.end());
+    } else if (matchptr != NULL) {
+      result->set_uend(matchptr);
+    }
+  }
+  return accept || matchptr != NULL;
+}
+
+} // namespace regen
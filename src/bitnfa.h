@@ -0,0 +1,76 @@
+#ifndef REGEN_BITNFA_H_
+#define REGEN_BITNFA_H_
+
+#include "regen.h"
+#include "util.h"
+#include "expr.h"
+#ifdef REGEN_ENABLE_PARALLEL
+#include <boost/thread.hpp>
+#endif
+
+namespace regen {
+
+/* bit-parallel simulation of the position (Glushkov) automaton, for the
+ * patterns of at most 64 positions whose DFA is too large to be built.
+ * the active positions are the bits of a word: a byte keeps the ones
+ * matching it (mask_), and the union of their follow sets is looked up
+ * 8 positions at a time (follow_).
+ * the `.*?' of partial matching is not a position: until a match is
+ * found, the first positions are added afresh after each byte, and they
+ * are dropped at a match, as the DFA does with its non-greedy states.
+ * a bounded repetition X{n,m} of a single position (see Counter) is one
+ * counted position: its threads are told apart by how many X they have
+ * read, and they may leave it after n to m of them. */
+class BitNFA {
+public:
+  typedef uint64_t word_t;
+  static const std::size_t MaxPositions = 64;
+  BitNFA(const ExprInfo &expr_info, const Regen::Options &flag);
+  /* whether the pattern fits: forward matching, at most MaxPositions
+   * positions, all literals, classes or dots (no anchors, operators or
+   * non-greedy repetitions). */
+  bool ok() const { return ok_; }
+  std::size_t size() const { return size_; }
+  std::size_t counter_num() const { return counters_.size(); }
+  bool Match(const Regen::StringPiece& string, Regen::StringPiece* result = NULL) const;
+  std::size_t memory_size() const;
+
+private:
+  class Counts;
+  struct CountedPosition {
+    word_t bit;
+    std::size_t lower;
+    std::size_t upper;
+    std::size_t base; // of its ring buffer in the counts
+  };
+  word_t Follow(word_t positions) const
+  {
+    word_t next = 0;
+    for (const word_t *table = &follow_[0]; positions != 0; positions >>= 8, table += 256) {
+      next |= table[positions & 0xff];
+    }
+    return next;
+  }
+  bool ok_;
+  Regen::Options flag_;
+  std::size_t size_;
+  /* positions at the start, and after each byte of the `.*?' prefix. */
+  word_t first_;
+  word_t accept_;
+  bool prefix_;
+  std::bitset<256> prefix_follow_;
+  word_t mask_[256];
+  std::vector<word_t> follow_;
+  word_t counted_;
+  std::vector<CountedPosition> counters_;
+  /* the counts of Match(), allocated once. a thread which finds them in
+   * use allocates its own. */
+  mutable std::vector<std::size_t> counts_;
+#ifdef REGEN_ENABLE_PARALLEL
+  mutable boost::mutex counts_mutex_;
+#endif
+};
+
+} // namespace regen
+
+#endif // REGEN_BITNFA_H_
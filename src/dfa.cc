@@ -3,23 +3,109 @@
 namespace regen {
 
 DFA::DFA(const ExprInfo &expr_info, std::size_t limit):
-    expr_info_(expr_info), complete_(false), minimum_(false), olevel_(Regen::Options::O0)
+    expr_info_(expr_info), reset_state_(UNDEF), accept_empty_(false), built_num_(0), flush_num_(0), on_the_fly_(false), complete_(false), minimum_(false), olevel_(Regen::Options::O0)
 #ifdef REGEN_ENABLE_XBYAK
-    , xgen_(NULL)
+    , xgen_(NULL), jitter_(NULL)
 #endif
 {
   complete_ = Construct(limit);
 }
 
 DFA::DFA(const NFA &nfa, std::size_t limit):
-    complete_(false), minimum_(false), olevel_(Regen::Options::O0)
+    reset_state_(UNDEF), accept_empty_(false), built_num_(0), flush_num_(0), on_the_fly_(false), complete_(false), minimum_(false), olevel_(Regen::Options::O0)
 #ifdef REGEN_ENABLE_XBYAK
-    , xgen_(NULL)
+    , xgen_(NULL), jitter_(NULL)
 #endif
 {
   complete_ = Construct(nfa, limit);
 }
 
+void DFA::set_expr_info(const ExprInfo &expr_info)
+{
+  expr_info_ = expr_info;
+  prefilter_ = Prefilter(expr_info_, flag_);
+}
+
+std::size_t DFA::SubsetTable::Hash(const Subset &subset)
+{
+  std::size_t hash = subset.size();
+  for (Subset::const_iterator iter = subset.begin(); iter != subset.end(); ++iter) {
+    std::size_t p = (std::size_t)*iter;
+    hash ^= (p >> 3) + 0x9e3779b9 + (hash << 6) + (hash >> 2);
+  }
+  return hash;
+}
+
+bool DFA::SubsetTable::Equal(state_t id, const Subset &subset) const
+{
+  if (offset_[id+1] - offset_[id] != subset.size()) return false;
+  StateExpr * const *elem = begin(id);
+  for (Subset::const_iterator iter = subset.begin(); iter != subset.end(); ++iter, ++elem) {
+    if (*iter != *elem) return false;
+  }
+  return true;
+}
+
+DFA::state_t DFA::SubsetTable::Find(const Subset &subset, std::size_t hash) const
+{
+  const std::size_t mask = buckets_.size() - 1;
+  for (std::size_t i = hash & mask; buckets_[i] != UNDEF; i = (i + 1) & mask) {
+    state_t id = buckets_[i];
+    if (hash_[id] == hash && Equal(id, subset)) return id;
+  }
+  return UNDEF;
+}
+
+DFA::state_t DFA::SubsetTable::Insert(const Subset &subset, std::size_t hash)
+{
+  state_t id = hash_.size();
+  hash_.push_back(hash);
+  elems_.insert(elems_.end(), subset.begin(), subset.end());
+  offset_.push_back(elems_.size());
+  if (hash_.size() * 2 > buckets_.size()) {
+    Rehash();
+  } else {
+    const std::size_t mask = buckets_.size() - 1;
+    std::size_t i = hash & mask;
+    while (buckets_[i] != UNDEF) i = (i + 1) & mask;
+    buckets_[i] = id;
+  }
+  return id;
+}
+
+void DFA::SubsetTable::Rehash()
+{
+  std::size_t size = buckets_.size();
+  while (hash_.size() * 2 > size) size *= 2;
+  buckets_.assign(size, UNDEF);
+  const std::size_t mask = size - 1;
+  for (state_t id = 0; id < hash_.size(); id++) {
+    std::size_t i = hash_[id] & mask;
+    while (buckets_[i] != UNDEF) i = (i + 1) & mask;
+    buckets_[i] = id;
+  }
+}
+
+void DFA::SubsetTable::Compact(const std::vector<state_t> &ids)
+{
+  SubsetTable table;
+  for (std::size_t i = 0; i < ids.size(); i++) {
+    table.hash_.push_back(hash_[ids[i]]);
+    table.elems_.insert(table.elems_.end(), begin(ids[i]), end(ids[i]));
+    table.offset_.push_back(table.elems_.size());
+  }
+  table.Rehash();
+  Swap(&table);
+}
+
+void DFA::SubsetTable::Swap(SubsetTable *other)
+{
+  elems_.swap(other->elems_);
+  offset_.swap(other->offset_);
+  hash_.swap(other->hash_);
+  buckets_.swap(other->buckets_);
+}
+
 bool DFA::ContainAcceptState(const Subset &states) const
 {
   for (Subset::iterator iter = states.begin(); iter != states.end(); ++iter) {
@@ -104,40 +190,44 @@ entry:
   }
 }
 
+/* `transition' is indexed by byte class (see ExprInfo::byte_class). */
 void DFA::FillTransition(StateExpr* state, std::vector<Subset>* transition) const
 {
+  const ByteClass &byte_class = expr_info_.byte_class;
   if (state->non_greedy()) MakeNonGreedy(state);
   switch (state->type()) {
     case Expr::kLiteral: {
       Literal *lit = static_cast<Literal*>(state);
       unsigned char index = lit->literal();
       if (index == flag_.delimiter() && !flag_.one_line()) break;
-      (*transition)[index].insert(lit->follow().begin(), lit->follow().end());
+      (*transition)[byte_class.map[index]].insert(lit->follow().begin(), lit->follow().end());
       break;
     }
     case Expr::kCharClass: {
       CharClass *cc = static_cast<CharClass*>(state);
-      for (std::size_t c = 0; c < 256; c++) {
+      for (std::size_t k = 0; k < byte_class.num; k++) {
+        unsigned char c = byte_class.rep[k];
         if (c == flag_.delimiter() && !flag_.one_line()) continue;
         if (cc->Match(c)) {
-          (*transition)[c].insert(cc->follow().begin(), cc->follow().end());
+          (*transition)[k].insert(cc->follow().begin(), cc->follow().end());
         }
       }
       break;
     }
     case Expr::kDot: {
       Dot *dot = static_cast<Dot*>(state);
-      for (std::size_t c = 0; c < 256; c++) {
+      for (std::size_t k = 0; k < byte_class.num; k++) {
+        unsigned char c = byte_class.rep[k];
         if (c == flag_.delimiter() && !flag_.one_line()
             && !dot->match_delimiter()) continue;
-        (*transition)[c].insert(dot->follow().begin(), dot->follow().end());
+        (*transition)[k].insert(dot->follow().begin(), dot->follow().end());
       }
       break;
     }
     case Expr::kAnchor:
       if (!flag_.one_line()) {
       Anchor* an = static_cast<Anchor*>(state);
-      (*transition)[flag_.delimiter()].insert(an->follow().begin(), an->follow().end());
+      (*transition)[byte_class.map[flag_.delimiter()]].insert(an->follow().begin(), an->follow().end());
       }
       break;
     default: break;
@@ -198,32 +288,36 @@ bool DFA::Construct(std::size_t limit)
 {
   if (expr_info_.expr_root == NULL) return false;
   
-  std::queue<Subset> queue;
-  std::vector<Subset> transition(256);
+  /* subsets are interned in the order they are found, so the queue of
+   * unprocessed subsets is just the range [size(), subsets_.size()). */
+  const ByteClass &byte_class = expr_info_.byte_class;
+  std::vector<Subset> transition(byte_class.num);
+  std::vector<state_t> class_transition(byte_class.num);
 
-  state_t dfa_id = 0;
   bool limit_over = false, begline = true;
   Subset states = expr_info_.expr_root->first();
+  /* a match ends the search for a leftmost one, but with several patterns
+   * it must not end the search for the others. */
+  const bool trim = expr_info_.pattern_num == 0;
 
   ExpandStates(&states, begline);
-  if (ContainAcceptState(states)) TrimNonGreedy(&states);
-  queue.push(states);
-  
-  nfa_map_[dfa_id] = states;
-  dfa_map_[states] = dfa_id++;
+  if (trim && ContainAcceptState(states)) TrimNonGreedy(&states);
+  subsets_.clear();
+  subsets_.Insert(states, SubsetTable::Hash(states));
 
-  while (!queue.empty()) {
-    states = queue.front();
-    queue.pop();
-
-    std::fill(transition.begin(), transition.end(), Subset());
-    for (Subset::iterator iter = states.begin(); iter != states.end(); ++iter) {
+  while (size() < subsets_.size()) {
+    const state_t id = size();
+    for (std::size_t k = 0; k < transition.size(); k++) transition[k].clear();
+    bool accept = false;
+    for (StateExpr * const *iter = subsets_.begin(id); iter != subsets_.end(id); ++iter) {
       FillTransition(*iter, &transition);
+      if ((*iter)->type() == Expr::kEOP) accept = true;
     }
 
     State &state = get_new_state();
     Transition &trans = transition_[state.id];
-    state.accept = ContainAcceptState(states);
+    state.accept = accept;
+    if (expr_info_.pattern_num != 0) FillMatchIds(id);
 
     if (!flag_.suffix_match() && flag_.shortest_match()) {
       /* Leftmost-Shortest matching
@@ -238,31 +332,35 @@ bool DFA::Construct(std::size_t limit)
       }
     }
 
-    // fill transitions of current state
-    for (std::size_t c = 0; c < 256; c++) {
-      Subset& next = transition[c];
+    // fill transitions of current state, per byte class
+    for (std::size_t k = 0; k < byte_class.num; k++) {
+      Subset& next = transition[k];
 
       if (next.empty()) {
-        trans[c] = REJECT;
+        class_transition[k] = REJECT;
         state.dst_states.insert(REJECT);
         continue;
       }
 
       ExpandStates(&next);
-      if (ContainAcceptState(next)) TrimNonGreedy(&next);
-      
-      if (dfa_map_.find(next) == dfa_map_.end()) {
-        if (dfa_id < limit) {
-          nfa_map_[dfa_id] = next;
-          dfa_map_[next] = dfa_id++;
-          queue.push(next); 
+      if (trim && ContainAcceptState(next)) TrimNonGreedy(&next);
+
+      const std::size_t hash = SubsetTable::Hash(next);
+      state_t next_id = subsets_.Find(next, hash);
+      if (next_id == UNDEF) {
+        if (subsets_.size() < limit) {
+          next_id = subsets_.Insert(next, hash);
         } else {
           limit_over = true;
+          class_transition[k] = UNDEF;
           continue;
         }
       }
-      trans[c] = dfa_map_[next];
-      state.dst_states.insert(dfa_map_[next]);
+      class_transition[k] = next_id;
+      state.dst_states.insert(next_id);
+    }
+    for (std::size_t c = 0; c < 256; c++) {
+      trans[c] = class_transition[byte_class.map[c]];
     }
     begline = false;
   }
@@ -344,9 +442,173 @@ void DFA::Finalize()
     }
   }
 
+  /* the state after a byte which no match can contain. */
+  reset_state_ = UNDEF;
+  for (std::size_t c = 0; c < 256 && !prefilter_.empty() && !empty(); c++) {
+    if (!expr_info_.involve[c] && c != flag_.delimiter()) {
+      if (transition_[0][c] != REJECT) reset_state_ = transition_[0][c];
+      break;
+    }
+  }
+
   complete_ = true;
 }
 
+void DFA::Flatten()
+{
+  FlatTable &flat = flat_table_;
+  flat.clear();
+
+  /* bytes which lead to the same state from every state share a class. */
+  std::vector<std::size_t> byte_class(256, 0);
+  std::size_t class_num = 1;
+  for (const_iterator state_iter = begin(); state_iter != end() && class_num < 256; ++state_iter) {
+    std::map<std::pair<std::size_t, state_t>, std::size_t> refine;
+    for (std::size_t c = 0; c < 256; c++) {
+      std::pair<std::size_t, state_t> key(byte_class[c], (*state_iter)[c]);
+      std::map<std::pair<std::size_t, state_t>, std::size_t>::iterator iter = refine.find(key);
+      if (iter == refine.end()) {
+        iter = refine.insert(std::make_pair(key, refine.size())).first;
+      }
+      byte_class[c] = iter->second;
+    }
+    class_num = refine.size();
+  }
+  std::vector<std::size_t> class_rep(class_num);
+  for (int c = 255; c >= 0; c--) {
+    flat.byte_class[c] = byte_class[c];
+    class_rep[byte_class[c]] = c;
+  }
+  flat.class_num = class_num;
+
+  /* non-accept states first, then accept states. */
+  const state_t n = size();
+  flat.to_flat.resize(n);
+  flat.from_flat.resize(n);
+  state_t id = 0;
+  for (state_t s = 0; s < n; s++) {
+    if (!states_[s].accept) flat.from_flat[flat.to_flat[s] = id++] = s;
+  }
+  flat.accept_begin = id;
+  for (state_t s = 0; s < n; s++) {
+    if (states_[s].accept) flat.from_flat[flat.to_flat[s] = id++] = s;
+  }
+  flat.size = n;
+
+  if (n < 0xff) {
+    flat.entry_size = sizeof(uint8_t);
+  } else if (n < 0xffff) {
+    flat.entry_size = sizeof(uint16_t);
+  } else {
+    flat.entry_size = sizeof(uint32_t);
+  }
+  flat.table.resize(n * class_num * flat.entry_size);
+  for (state_t i = 0; i < n; i++) {
+    const Transition &trans = transition_[flat.from_flat[i]];
+    for (std::size_t k = 0; k < class_num; k++) {
+      state_t next = trans[class_rep[k]];
+      next = next == REJECT ? n : flat.to_flat[next];
+      std::size_t index = i * class_num + k;
+      switch (flat.entry_size) {
+        case sizeof(uint8_t):  flat.table[index] = next; break;
+        case sizeof(uint16_t): ((uint16_t *)&flat.table[0])[index] = next; break;
+        default:               ((uint32_t *)&flat.table[0])[index] = next; break;
+      }
+    }
+  }
+}
+
+/* run the flat table from `state' (flat id) over [*str, end). stops in front
+ * of the byte which leads to REJECT (returning reject), or right after
+ * entering `stop', and records the position after the last accept state in
+ * `matchptr' when it is given. */
+template<typename T>
+static DFA::state_t FlatMatch(const DFA::FlatTable &flat, DFA::state_t state,
+                              const unsigned char **str, const unsigned char *end, int sign,
+                              const unsigned char **matchptr, DFA::state_t stop)
+{
+  const T *table = (const T *)&flat.table[0];
+  const unsigned char *byte_class = flat.byte_class;
+  const std::size_t class_num = flat.class_num;
+  const DFA::state_t reject = flat.size, accept_begin = flat.accept_begin;
+  const unsigned char *p = *str;
+  if (matchptr == NULL) {
+    while (p != end) {
+      DFA::state_t next = table[state * class_num + byte_class[*p]];
+      if (next == reject) { state = reject; break; }
+      state = next;
+      p += sign;
+      if (state == stop) break;
+    }
+  } else {
+    while (p != end) {
+      DFA::state_t next = table[state * class_num + byte_class[*p]];
+      if (next == reject) { state = reject; break; }
+      state = next;
+      p += sign;
+      if (state >= accept_begin) *matchptr = p;
+      if (state == stop) break;
+    }
+  }
+  *str = p;
+  return state;
+}
+
+/* run the flat table forward from `state' over at least one byte of
+ * [*str, end), until it enters an accept state or REJECT. */
+template<typename T>
+static DFA::state_t FlatMatchAccept(const DFA::FlatTable &flat, DFA::state_t state,
+                                    const unsigned char **str, const unsigned char *end)
+{
+  const T *table = (const T *)&flat.table[0];
+  const unsigned char *byte_class = flat.byte_class;
+  const std::size_t class_num = flat.class_num;
+  const DFA::state_t reject = flat.size, accept_begin = flat.accept_begin;
+  const unsigned char *p = *str;
+  do {
+    state = table[state * class_num + byte_class[*p]];
+    if (state == reject) break;
+    p++;
+  } while (p != end && state < accept_begin);
+  *str = p;
+  return state;
+}
+
+/* whether input may end at `state': the state accepts, or it accepts
+ * once the trailing anchors ('$') are expanded. */
+bool DFA::AcceptAtEnd(std::size_t state, bool begline) const
+{
+  if (state == REJECT) return false;
+  if (IsAcceptState(state)) return true;
+  if (state >= subsets_.size()) {
+    return IsEndlineState(state) || (begline && state == start_state() && accept_empty_);
+  }
+  Subset endstates = subsets_.Get(state);
+  ExpandStates(&endstates, begline, true);
+  return ContainAcceptState(endstates);
+}
+
+/* ids of the patterns whose EOP is in the subset of `state', as is and
+ * with trailing anchors expanded. */
+void DFA::FillMatchIds(state_t state) const
+{
+  State &s = states_[state];
+  Subset subset = subsets_.Get(state);
+  s.ids.clear();
+  for (Subset::iterator iter = subset.begin(); iter != subset.end(); ++iter) {
+    if ((*iter)->type() == Expr::kEOP) s.ids.push_back(static_cast<EOP*>(*iter)->id());
+  }
+  ExpandStates(&subset, false, true);
+  s.end_ids = s.ids;
+  for (Subset::iterator iter = subset.begin(); iter != subset.end(); ++iter) {
+    if ((*iter)->type() == Expr::kEOP) s.end_ids.push_back(static_cast<EOP*>(*iter)->id());
+  }
+  std::sort(s.ids.begin(), s.ids.end());
+  s.ids.erase(std::unique(s.ids.begin(), s.ids.end()), s.ids.end());
+  std::sort(s.end_ids.begin(), s.end_ids.end());
+  s.end_ids.erase(std::unique(s.end_ids.begin(), s.end_ids.end()), s.end_ids.end());
+}
+
 DFA::State& DFA::get_new_state() const
 {
   transition_.resize(states_.size()+1);
@@ -368,100 +630,192 @@ void DFA::state2label(state_t state, char* labelbuf) const
   }
 }
 
+/* Hopcroft's partition refinement, O(n log n) per byte class.
+ * REJECT is treated as an extra (dead) state, so states which can
+ * never accept are folded into REJECT. */
 bool DFA::Minimize()
 {
   if (!complete_) return false;
-  if (minimum_) return true;
-  
-  std::vector<std::vector<bool> > distinction_table;
-  distinction_table.resize(size()-1);
-  for (state_t i = 0; i < size()-1; i++) {
-    distinction_table[i].resize(size()-i-1);
-    for (state_t j = i+1; j < size(); j++) {
-      distinction_table[i][size()-j-1] = states_[i].accept != states_[j].accept;
-    }
-  }
-
-  bool distinction_flag = true;
-  while (distinction_flag) {
-    distinction_flag = false;
-    for (state_t i = 0; i < size()-1; i++) {
-      for (state_t j = i+1; j < size(); j++) {
-        if (!distinction_table[i][size()-j-1]) {
-          for (std::size_t input = 0; input < 256; input++) {
-            state_t n1, n2;
-            n1 = transition_[i][input];
-            n2 = transition_[j][input];
-            if (n1 != n2) {
-              if (n1 > n2) std::swap(n1, n2);
-              if ((n1 == REJECT || n2 == REJECT) ||
-                  distinction_table[n1][size()-n2-1]) {
-                distinction_flag = true;
-                distinction_table[i][size()-j-1] = true;
-                break;
-              }
-            }
-          }
-        }
-      }
+  if (minimum_ || empty()) return true;
+
+  Flatten(); // for the byte classes of the current transitions.
+  const std::size_t class_num = flat_table_.class_num;
+  std::vector<unsigned char> class_rep(class_num);
+  for (int c = 255; c >= 0; c--) class_rep[flat_table_.byte_class[c]] = c;
+  flat_table_.clear();
+
+  const state_t n = size(), dead = n, state_num = n + 1;
+
+  /* predecessors of each state per byte class (CSR). */
+  std::vector<std::size_t> pred_index(class_num * state_num + 1, 0);
+  std::vector<state_t> pred(class_num * state_num);
+  for (std::size_t k = 0; k < class_num; k++) {
+    for (state_t s = 0; s < state_num; s++) {
+      state_t t = s == dead ? dead : transition_[s][class_rep[k]];
+      if (t == REJECT) t = dead;
+      pred_index[k * state_num + t + 1]++;
     }
   }
-  
-  std::map<state_t, state_t> swap_map;
-  for (state_t i = 0; i < size()-1; i++) {
-    for (state_t j = i+1; j < size(); j++) {
-      if (swap_map.find(j) == swap_map.end()) {
-        if (!distinction_table[i][size()-j-1]) {
-          swap_map[j] = i;
-        }
+  for (std::size_t i = 1; i < pred_index.size(); i++) pred_index[i] += pred_index[i-1];
+  {
+    std::vector<std::size_t> fill(pred_index.begin(), pred_index.end() - 1);
+    for (std::size_t k = 0; k < class_num; k++) {
+      for (state_t s = 0; s < state_num; s++) {
+        state_t t = s == dead ? dead : transition_[s][class_rep[k]];
+        if (t == REJECT) t = dead;
+        pred[fill[k * state_num + t]++] = s;
       }
     }
   }
 
-  if (swap_map.empty()) {
-    minimum_ = true;
-    return true;
+  /* initial partition: states are told apart by acceptance, and by
+   * acceptance at the end of input (trailing anchors), and with several
+   * patterns by which of them they accept. */
+  std::vector<state_t> elems(state_num), location(state_num), block_of(state_num);
+  std::vector<std::size_t> block_begin, block_end, block_marked;
+  {
+    typedef std::pair<std::vector<std::size_t>, std::vector<std::size_t> > Ids;
+    typedef std::pair<std::pair<bool, bool>, Ids> Key;
+    std::map<Key, std::size_t> initial;
+    std::vector<Key> keys(state_num, Key(std::make_pair(false, false), Ids()));
+    for (state_t s = 0; s < n; s++) {
+      keys[s] = Key(std::make_pair((bool)states_[s].accept, AcceptAtEnd(s)),
+                    Ids(states_[s].ids, states_[s].end_ids));
+    }
+    for (state_t s = 0; s < state_num; s++) {
+      if (initial.find(keys[s]) == initial.end()) {
+        std::size_t id = initial.size();
+        initial[keys[s]] = id;
+        block_begin.push_back(0);
+        block_end.push_back(0);
+      }
+      block_of[s] = initial[keys[s]];
+      block_end[block_of[s]]++;
+    }
+    for (std::size_t b = 1; b < block_begin.size(); b++) {
+      block_begin[b] = block_end[b-1];
+      block_end[b] += block_begin[b];
+    }
+    std::vector<std::size_t> fill(block_begin);
+    for (state_t s = 0; s < state_num; s++) {
+      location[s] = fill[block_of[s]]++;
+      elems[location[s]] = s;
+    }
+    block_marked.resize(block_begin.size(), 0);
   }
 
-  size_t minimum_size = size() - swap_map.size();
-  std::vector<state_t> replace_map(size());
-  for (state_t s = 0, d = 0; s < size(); s++) {
-    if (swap_map.find(s) == swap_map.end()) {
-      replace_map[s] = d++;
-      if (s != replace_map[s]) {
-        transition_[replace_map[s]] = transition_[s];
-        states_[replace_map[s]] = states_[s];
-        states_[replace_map[s]].id = replace_map[s];
-      }
-    } else {
-      replace_map[s] = replace_map[swap_map[s]];
+  std::vector<std::size_t> worklist;
+  std::vector<bool> in_worklist(block_begin.size(), true);
+  {
+    std::size_t largest = 0;
+    for (std::size_t b = 0; b < block_begin.size(); b++) {
+      if (block_end[b] - block_begin[b] > block_end[largest] - block_begin[largest]) largest = b;
+    }
+    for (std::size_t b = 0; b < block_begin.size(); b++) {
+      if (b != largest) worklist.push_back(b);
     }
+    in_worklist[largest] = false;
   }
 
-  std::set<state_t> tmp_set;
-  for (iterator state_iter = begin(); state_iter->id < minimum_size; ++state_iter) {
-    State &state = *state_iter;
-    for (std::size_t input = 0; input < 256; input++) {
-      state_t n = state[input];
-      if (n != REJECT) {
-        state[input] = replace_map[n];
+  std::vector<state_t> splitter;
+  std::vector<std::size_t> touched;
+  while (!worklist.empty()) {
+    std::size_t a = worklist.back();
+    worklist.pop_back();
+    in_worklist[a] = false;
+    splitter.assign(elems.begin() + block_begin[a], elems.begin() + block_end[a]);
+
+    for (std::size_t k = 0; k < class_num; k++) {
+      touched.clear();
+      for (std::size_t i = 0; i < splitter.size(); i++) {
+        std::size_t index = k * state_num + splitter[i];
+        for (std::size_t j = pred_index[index]; j < pred_index[index+1]; j++) {
+          state_t p = pred[j];
+          std::size_t b = block_of[p];
+          std::size_t front = block_begin[b] + block_marked[b];
+          if (location[p] < front) continue; // already marked
+          if (block_marked[b] == 0) touched.push_back(b);
+          state_t q = elems[front];
+          std::swap(elems[front], elems[location[p]]);
+          location[q] = location[p];
+          location[p] = front;
+          block_marked[b]++;
+        }
+      }
+      for (std::size_t i = 0; i < touched.size(); i++) {
+        std::size_t b = touched[i];
+        std::size_t marked = block_marked[b];
+        block_marked[b] = 0;
+        if (marked == block_end[b] - block_begin[b]) continue;
+        /* the marked front part becomes a new block. */
+        std::size_t nb = block_begin.size();
+        block_begin.push_back(block_begin[b]);
+        block_end.push_back(block_begin[b] + marked);
+        block_marked.push_back(0);
+        block_begin[b] += marked;
+        for (std::size_t l = block_begin[nb]; l < block_end[nb]; l++) block_of[elems[l]] = nb;
+        if (in_worklist[b] || marked <= block_end[b] - block_begin[b]) {
+          worklist.push_back(nb);
+          in_worklist.push_back(true);
+        } else {
+          worklist.push_back(b);
+          in_worklist[b] = true;
+          in_worklist.push_back(false);
+        }
       }
     }
-    tmp_set.clear();
-    for (std::set<state_t>::iterator iter = state.dst_states.begin(); iter != state.dst_states.end(); ++iter) {
-      if (*iter != REJECT) tmp_set.insert(replace_map[*iter]);
-      else tmp_set.insert(REJECT);
+  }
+
+  /* renumber blocks in the order of their smallest state, so that the
+   * start state stays 0. states equivalent to the dead state are
+   * replaced by REJECT. */
+  const std::size_t dead_block = block_of[dead];
+  std::vector<state_t> block_id(block_begin.size(), UNDEF);
+  std::vector<state_t> replace_map(n), represent;
+  for (state_t s = 0; s < n; s++) {
+    std::size_t b = block_of[s];
+    if (b == dead_block && b != block_of[start_state()]) {
+      replace_map[s] = REJECT;
+      continue;
     }
-    state.dst_states = tmp_set;
-    tmp_set.clear();
-    for (std::set<state_t>::iterator iter = state.src_states.begin(); iter != state.src_states.end(); ++iter) {
-      tmp_set.insert(replace_map[*iter]);
+    if (block_id[b] == UNDEF) {
+      block_id[b] = represent.size();
+      represent.push_back(s);
     }
-    state.src_states = tmp_set;
+    replace_map[s] = block_id[b];
   }
 
-  transition_.resize(minimum_size);
-  states_.resize(minimum_size);
+  if (represent.size() == n) {
+    minimum_ = true;
+    return true;
+  }
+
+  const std::size_t minimum_size = represent.size();
+  std::vector<Transition> transition(minimum_size);
+  std::deque<State> states(minimum_size);
+  for (state_t i = 0; i < minimum_size; i++) {
+    const state_t s = represent[i];
+    const Transition &trans = transition_[s];
+    for (std::size_t c = 0; c < 256; c++) {
+      transition[i][c] = trans[c] == REJECT ? REJECT : replace_map[trans[c]];
+    }
+    State &state = states[i];
+    state = states_[s];
+    state.id = i;
+    state.dst_states.clear();
+    state.src_states.clear();
+    for (std::size_t c = 0; c < 256; c++) {
+      state.dst_states.insert(transition[i][c]);
+    }
+  }
+  transition_.swap(transition);
+  states_.swap(states);
+  std::vector<state_t> interned;
+  for (state_t i = 0; i < minimum_size && represent[i] < subsets_.size(); i++) {
+    interned.push_back(represent[i]);
+  }
+  subsets_.Compact(interned);
+  Finalize();
 
   minimum_ = true;
   return true;
@@ -469,6 +823,9 @@ bool DFA::Minimize()
 
 void DFA::Complementify()
 {
+  flat_table_.clear();
+  prefilter_ = Prefilter();
+  reset_state_ = UNDEF;
   state_t reject = REJECT;
   for (iterator state_iter = begin(); state_iter != end(); ++state_iter) {
     State &state = *state_iter;
@@ -499,6 +856,13 @@ void DFA::Complementify()
 }
 
 #if REGEN_ENABLE_XBYAK
+std::size_t JITCompiler::table_width(const DFA &dfa)
+{
+  if (dfa.flat_table().empty()
+      || dfa.size() * 256 * sizeof(void *) <= MaxFullTableSize) return 256;
+  return dfa.flat_table().class_num;
+}
+
 JITCompiler::JITCompiler(const DFA &dfa, std::size_t state_code_size = 64):
     /* code segment for state transition.
      *   each states code was 16byte alligned.
@@ -507,13 +871,17 @@ JITCompiler::JITCompiler(const DFA &dfa, std::size_t state_code_size = 64):
      *                        ~~
      * data segment for transition table
      *                                                */
-    CodeGenerator(code_segment_size(dfa.size()) + data_segment_size(dfa.size())),
+    CodeGenerator(code_segment_size(dfa.size()) + data_segment_size(dfa.size(), table_width(dfa))),
     code_segment_size_(code_segment_size(dfa.size())),
-    data_segment_size_(data_segment_size(dfa.size())),
-    total_segment_size_(code_segment_size(dfa.size())+data_segment_size(dfa.size())), filter_entry_(NULL),
-    reset_state_(DFA::UNDEF)
+    data_segment_size_(data_segment_size(dfa.size(), table_width(dfa))),
+    total_segment_size_(code_segment_size_+data_segment_size_), filter_entry_(NULL),
+    reset_state_(DFA::UNDEF), table_width_(table_width(dfa))
 {
   states_addr_.resize(dfa.size());
+  const bool class_table = table_width_ != 256;
+  for (std::size_t c = 0; c < 256; c++) {
+    byte_class_[c] = class_table ? dfa.flat_table().byte_class[c] : c;
+  }
 
   const uint8_t* code_addr_top = getCurr();
   const uint8_t** transition_table_ptr = (const uint8_t **)(code_addr_top + code_segment_size_);
@@ -550,8 +918,22 @@ JITCompiler::JITCompiler(const DFA &dfa, std::size_t state_code_size = 64):
   const Xbyak::Reg64& tmp2(r11);
   const Xbyak::Reg64& reg_a(rax);
 #endif
+  bool keyword_filter = false;
+#ifndef XBYAK32
+  if (dfa.reset_state() != DFA::UNDEF) {
+    reset_state_ = dfa.reset_state();
+    keyword_filter = true;
+  }
+#endif
+
   // setup enviroment on register
   const int sign = dfa.flag().reverse_match() ? -1 : 1;
+  if (keyword_filter) {
+    /* Prefilter::Candidate's cache */
+    mov(tmp1, 0);
+    push(tmp1);
+    push(tmp1);
+  }
   push(arg2);
   push(arg1);
   mov(tbl, (size_t)transition_table_ptr);
@@ -560,7 +942,14 @@ JITCompiler::JITCompiler(const DFA &dfa, std::size_t state_code_size = 64):
   mov(arg1, ptr[arg1]);
 
   mov(tmp1, (std::size_t)&(states_addr_[0]));
-  jmp(ptr[tmp1+arg3*sizeof(uint8_t*)]);
+  if (class_table) {
+    /* arg3 holds the byte class map after the initial jump. */
+    mov(tmp1, ptr[tmp1+arg3*sizeof(uint8_t*)]);
+    mov(arg3, (std::size_t)byte_class_);
+    jmp(tmp1);
+  } else {
+    jmp(ptr[tmp1+arg3*sizeof(uint8_t*)]);
+  }
 
   L("reject");
   const uint8_t *reject_state_addr = getCurr();
@@ -575,6 +964,7 @@ JITCompiler::JITCompiler(const DFA &dfa, std::size_t state_code_size = 64):
   mov(ptr[tmp1], tmp2);
 
   L("finalize");
+  if (keyword_filter) add(rsp, 2*sizeof(uint8_t*));
 #ifdef XBYAK32
   pop(ebx);
   pop(ebp);
@@ -588,21 +978,51 @@ JITCompiler::JITCompiler(const DFA &dfa, std::size_t state_code_size = 64):
 
   if (dfa.flag().filtered_match()) {
     /* generate filter code conditionaly. */
-    if (dfa.expr_info().key.longest_keyword().length() > 1) {
+    if (keyword_filter) {
       /* regex has keyword (which will be contained acceptable string certainly).
-         so, we can try to search keyword firstly. */
-      if (mie::isAvaiableSSE42()) {
-        /* fastest keyword search with SSE4.2. */
-      } else {
-        /* or simple quick search algorithm. */
-      }
-    } else if (dfa.expr_info().key.longest_keyword().length() > 1) {
-      /* memchr */
-      
-    }
-    else if (dfa.expr_info().involve.count() < 126 && dfa.expr_info().min_length > 2) {
+         so, we can try to search keyword firstly (see Prefilter). */
+#ifndef XBYAK32
+      L("filter");
+      filter_entry_ = getCurr();
+      const unsigned char *(*candidate)(const unsigned char *, const unsigned char *,
+                                        const unsigned char **, const Prefilter *) = Prefilter::Candidate;
+      push(arg1);
+      push(arg2);
+      push(arg3);
+      push(tbl);
+      push(tmp2);
+      /* Prefilter::Candidate(arg1, arg2, cache, &dfa.prefilter()),
+       * cache is above the 5 registers and string pointers saved on entry. */
+#ifdef XBYAK64_WIN
+      lea(r8, ptr[rsp + 7*sizeof(uint8_t*)]);
+      mov(r9, (std::size_t)&dfa.prefilter());
+      sub(rsp, 32);
+      mov(reg_a, (std::size_t)candidate);
+      call(reg_a);
+      add(rsp, 32);
+#else
+      lea(rdx, ptr[rsp + 7*sizeof(uint8_t*)]);
+      mov(rcx, (std::size_t)&dfa.prefilter());
+      mov(reg_a, (std::size_t)candidate);
+      call(reg_a);
+#endif
+      pop(tmp2);
+      pop(tbl);
+      pop(arg3);
+      pop(arg2);
+      pop(arg1);
+      mov(arg1, reg_a);
+      cmp(arg1, arg2);
+      je("reject", T_NEAR);
+      char labelbuf[100];
+      dfa.state2label(reset_state_, labelbuf);
+      jmp(labelbuf, T_NEAR);
+      align(16);
+#endif
+    } else if (dfa.expr_info().involve.count() < 126 && dfa.expr_info().min_length > 2) {
       /* (cheap but effective) quick filter. */
       std::size_t len = dfa.expr_info().min_length;
+      L("filter");
       filter_entry_ = getCurr();
       filter_table_.resize(256);
       mov(reg_a, (size_t)&(filter_table_[0]));
@@ -645,7 +1065,9 @@ JITCompiler::JITCompiler(const DFA &dfa, std::size_t state_code_size = 64):
     states_addr_[i] = getCurr();
     if (dfa.IsAcceptState(i) && !dfa.flag().suffix_match()) {
       mov(tmp2, arg1);
-      if (dfa.flag().shortest_match()) {
+      /* with several patterns, DFA::MatchSet collects the ids of each
+       * accept state on the way. */
+      if (dfa.flag().shortest_match() || dfa.expr_info().pattern_num != 0) {
         mov(reg_a, i);
         jmp("return");
       }
@@ -676,6 +1098,7 @@ JITCompiler::JITCompiler(const DFA &dfa, std::size_t state_code_size = 64):
       transition_depth++;
       assert(at.next1 != DFA::UNDEF);
       dfa.state2label(at.next1, labelbuf);
+      if (filter_entry_ != NULL && at.next1 == reset_state_) strcpy(labelbuf, "filter");
       if (at.next1 != DFA::REJECT) {
         jn_flag = true;  
       }
@@ -717,6 +1140,7 @@ JITCompiler::JITCompiler(const DFA &dfa, std::size_t state_code_size = 64):
           }
         }
         dfa.state2label(at.next2, labelbuf);
+        if (filter_entry_ != NULL && at.next2 == reset_state_) strcpy(labelbuf, "filter");
         if (transition_depth == inline_level) {
           jmp(labelbuf, T_NEAR);
         } else {
@@ -735,7 +1159,8 @@ JITCompiler::JITCompiler(const DFA &dfa, std::size_t state_code_size = 64):
         je("@f", T_NEAR);
         movzx(tmp1, byte[arg1]);
         add(arg1, sign);
-        jmp(ptr[tbl+i*256*sizeof(uint8_t*)+tmp1*sizeof(uint8_t*)]);
+        if (class_table) movzx(tmp1, byte[arg3+tmp1]);
+        jmp(ptr[tbl+i*table_width_*sizeof(uint8_t*)+tmp1*sizeof(uint8_t*)]);
         L("@@");
         mov(reg_a, i);
         jmp("return");
@@ -750,7 +1175,8 @@ JITCompiler::JITCompiler(const DFA &dfa, std::size_t state_code_size = 64):
       je("@f");
       movzx(tmp1, byte[arg1]);
       add(arg1, sign);
-      jmp(ptr[tbl+i*256*sizeof(uint8_t*)+tmp1*sizeof(uint8_t*)]);
+      if (class_table) movzx(tmp1, byte[arg3+tmp1]);
+      jmp(ptr[tbl+i*table_width_*sizeof(uint8_t*)+tmp1*sizeof(uint8_t*)]);
       L("@@");
       mov(reg_a, i);
       jmp("return");
@@ -762,13 +1188,14 @@ JITCompiler::JITCompiler(const DFA &dfa, std::size_t state_code_size = 64):
   for (std::size_t i = 0; i < dfa.size(); i++) {
     const DFA::Transition &trans = dfa.GetTransition(i);
     for (int c = 0; c < 256; c++) {
+      const std::size_t k = byte_class_[c];
       DFA::state_t next = trans[c];
       if (next == DFA::REJECT) {
-        transition_table_ptr[i*256+c] = reject_state_addr;
+        transition_table_ptr[i*table_width_+k] = reject_state_addr;
       } else if (filter_entry_ != NULL && next == reset_state_) {
-        transition_table_ptr[i*256+c] = filter_entry_;
+        transition_table_ptr[i*table_width_+k] = filter_entry_;
       } else {
-        transition_table_ptr[i*256+c] = states_addr_[next];
+        transition_table_ptr[i*table_width_+k] = states_addr_[next];
       }
     }
   }
@@ -841,7 +1268,17 @@ bool DFA::Reduce()
 
 bool DFA::Compile(Regen::Options::CompileFlag olevel)
 {
-  if (!complete_) return false;
+  if (!complete_) {
+    /* too many states to build beforehand: JIT them as they are found. */
+#ifndef XBYAK32
+    if (olevel >= Regen::Options::O1 && jitter_ == NULL) {
+      jitter_ = new Jitter(*this);
+      jitter_->Init();
+    }
+#endif
+    return false;
+  }
+  if (flat_table_.empty()) Flatten();
   if (olevel <= olevel_) return true;
   if (olevel >= Regen::Options::O2) {
     if (EliminateBranch()) {
@@ -851,6 +1288,7 @@ bool DFA::Compile(Regen::Options::CompileFlag olevel)
       olevel_ = Regen::Options::O3;
     }
   }
+  delete xgen_;
   xgen_ = new JITCompiler(*this);
   CompiledMatch = (state_t (*)(const unsigned char**, const unsigned char**, state_t))xgen_->getCode();
   if (olevel_ < Regen::Options::O1) olevel_ = Regen::Options::O1;
@@ -859,49 +1297,80 @@ bool DFA::Compile(Regen::Options::CompileFlag olevel)
 #else
 bool DFA::EliminateBranch() { return false; }
 bool DFA::Reduce() { return false; }
-bool DFA::Compile(Regen::Options::CompileFlag) { return false; }
+bool DFA::Compile(Regen::Options::CompileFlag)
+{
+  if (complete_ && flat_table_.empty()) Flatten();
+  return false;
+}
 #endif
 
 bool DFA::Match(const Regen::StringPiece &string, Regen::StringPiece *result) const
 {
   if (!complete_) return OnTheFlyMatch(string, result);
+  return Match(string, result, start_state());
+}
 
+/* run the complete DFA over `string' from `state'. */
+bool DFA::Match(const Regen::StringPiece &string, Regen::StringPiece *result, state_t state) const
+{
   Regen::StringPiece string_(string);
   int sign = 1;
   const unsigned char* matchptr = NULL;
+  const bool begline = string.empty() && state == start_state();
   if (flag_.reverse_match()) {
     sign = -1;
     string_.reverse();
   }
-  state_t state = 0;
   bool accept = false;
 
   if (olevel_ >= Regen::Options::O1) {
     /* JITed matching */
     const unsigned char **arg1 = string_._udata();
     state = CompiledMatch(arg1, &matchptr, state);
-  } else {
-    if (result == NULL) {
-      while (!string_.empty() && (state = transition_[state][*string_.udata()]) != DFA::REJECT) {
-        string_.consume(sign);
+  } else if (!flat_table_.empty()) {
+    const FlatTable &flat = flat_table_;
+    const unsigned char **track = flag_.suffix_match() ? NULL : &matchptr;
+    if (track != NULL && IsAcceptState(state)) matchptr = string_.udata();
+    const unsigned char **str = string_._udata();
+    const unsigned char *cache[2] = {NULL, NULL};
+    const state_t stop = reset_state_ < size() ? flat.to_flat[reset_state_] : flat.size + 1;
+    state_t s = flat.to_flat[state];
+    for (;;) {
+      switch (flat.entry_size) {
+        case sizeof(uint8_t):  s = FlatMatch<uint8_t>(flat, s, str, string_.uend(), sign, track, stop); break;
+        case sizeof(uint16_t): s = FlatMatch<uint16_t>(flat, s, str, string_.uend(), sign, track, stop); break;
+        default:               s = FlatMatch<uint32_t>(flat, s, str, string_.uend(), sign, track, stop); break;
       }
-    } else {
-      if (IsAcceptState(state)) matchptr = string_.udata();
-      while (!string_.empty() && (state = transition_[state][*string_.udata()]) != DFA::REJECT) {
-        if (IsAcceptState(state)) matchptr = string_.udata();
-        string_.consume(sign);
+      if (s != stop || *str == string_.uend()) break;
+      *str = prefilter_.Candidate(*str, string_.uend(), cache);
+      if (*str == string_.uend()) s = flat.size;
+    }
+    state = s == flat.size ? REJECT : flat.from_flat[s];
+  } else {
+    const bool track = !flag_.suffix_match();
+    const unsigned char *cache[2] = {NULL, NULL};
+    if (track && IsAcceptState(state)) matchptr = string_.udata();
+    while (string_.begin() != string_.end()) {
+      if (state == reset_state_) {
+        string_.set_ubegin(prefilter_.Candidate(string_.ubegin(), string_.uend(), cache));
+        if (string_.begin() == string_.end()) {
+          state = REJECT;
+          break;
+        }
       }
+      if ((state = transition_[state][*string_.udata()]) == REJECT) break;
+      string_.consume(sign);
+      if (track && IsAcceptState(state)) matchptr = string_.udata();
     }
   }
 
-  accept = IsAcceptState(state);
-  if (!accept && state != REJECT && string_.empty()) {
-    Subset endstates = nfa_map_[state];
-    ExpandStates(&endstates, string.empty(), true);
-    accept = ContainAcceptState(endstates);
+  if (string_.begin() == string_.end()) {
+    accept = AcceptAtEnd(state, begline);
+  } else {
+    accept = IsAcceptState(state);
   }
   if (result == NULL) {
-    return accept;
+    return accept || matchptr != NULL;
   } else {
     if (flag_.suffix_match() && accept) {
       if (flag_.reverse_match()) {
@@ -911,7 +1380,14 @@ bool DFA::Match(const Regen::StringPiece &string, Regen::StringPiece *result) co
       }
       return true;
     } else {
-      if (accept |= matchptr != NULL) {
+      if (matchptr == NULL && accept) {
+        /* only an anchor at the end of the input, e.g. "cd$" */
+        if (flag_.reverse_match()) {
+          result->set_begin(string.begin());
+        } else {
+          result->set_end(string.end());
+        }
+      } else if (accept |= matchptr != NULL) {
         if (flag_.reverse_match()) {
           result->set_ubegin(matchptr+1);
         } else {
@@ -923,71 +1399,513 @@ bool DFA::Match(const Regen::StringPiece &string, Regen::StringPiece *result) co
   }
 }
 
-bool DFA::OnTheFlyMatch(const Regen::StringPiece& string, Regen::StringPiece* result) const
+static const char ImageMagic[8] = {'R', 'E', 'G', 'E', 'N', 'D', 'F', 'A'};
+
+static std::size_t ImageFlagsSize(std::size_t state_num)
+{
+  return (state_num + 3) & ~static_cast<std::size_t>(3);
+}
+
+bool DFA::Serialize(const Regen::StringPiece &pattern, std::string *image) const
+{
+  if (!complete_ || expr_info_.pattern_num != 0) return false;
+  ImageHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, ImageMagic, sizeof(header.magic));
+  header.version = ImageVersion;
+  header.parse_flag = flag_.parse_flag();
+  header.delimiter = flag_.delimiter();
+  header.state_num = size();
+  header.min_length = expr_info_.min_length;
+  header.max_length = expr_info_.max_length;
+  header.thread_num = flag_.thread_num();
+  header.pattern_size = pattern.size();
+  for (std::size_t c = 0; c < 256; c++) header.involve[c] = expr_info_.involve[c];
+
+  std::string flags(ImageFlagsSize(size()), 0);
+  for (std::size_t i = 0; i < size(); i++) {
+    flags[i] = (states_[i].accept ? 1 : 0) | (AcceptAtEnd(i) ? 2 : 0)
+        | (i == start_state() && AcceptAtEnd(i, true) ? 4 : 0);
+  }
+  image->assign((const char *)&header, sizeof(header));
+  image->append(flags);
+  for (std::size_t i = 0; i < size(); i++) {
+    image->append((const char *)&transition_[i][0], sizeof(Transition));
+  }
+  image->append(pattern.begin(), pattern.size());
+  return true;
+}
+
+bool DFA::ReadImageHeader(const Regen::StringPiece &image, ImageHeader *header, Regen::StringPiece *pattern)
+{
+  if (image.size() < sizeof(ImageHeader)) return false;
+  memcpy(header, image.begin(), sizeof(ImageHeader));
+  if (memcmp(header->magic, ImageMagic, sizeof(header->magic)) != 0
+      || header->version != ImageVersion || header->state_num == 0) return false;
+  const std::size_t offset = sizeof(ImageHeader) + ImageFlagsSize(header->state_num)
+      + header->state_num * sizeof(Transition);
+  if (image.size() != offset + header->pattern_size) return false;
+  pattern->set(image.begin() + offset, header->pattern_size);
+  return true;
+}
+
+/* the flags and the options have to be those of the image (see
+ * Regex::Load). the DFA is complete and minimal afterwards, but has no
+ * expression behind it: no keyword prefilter, no on-the-fly states. */
+bool DFA::Deserialize(const Regen::StringPiece &image)
+{
+  ImageHeader header;
+  Regen::StringPiece pattern;
+  if (!ReadImageHeader(image, &header, &pattern)) return false;
+  const std::size_t n = header.state_num;
+  const unsigned char *flags = image.ubegin() + sizeof(ImageHeader);
+  const unsigned char *table = flags + ImageFlagsSize(n);
+
+  transition_.clear();
+  states_.clear();
+  subsets_.clear();
+  flat_table_.clear();
+  for (std::size_t i = 0; i < n; i++) {
+    State &state = get_new_state();
+    memcpy(&transition_[i][0], table + i * sizeof(Transition), sizeof(Transition));
+    state.accept = flags[i] & 1;
+    state.endline = flags[i] & 2;
+    if (i == start_state()) accept_empty_ = flags[i] & 4;
+    for (std::size_t c = 0; c < 256; c++) {
+      const state_t next = transition_[i][c];
+      if (next != REJECT && next >= n) {
+        transition_.clear();
+        states_.clear();
+        return false;
+      }
+      state.dst_states.insert(next);
+    }
+  }
+  expr_info_ = ExprInfo();
+  expr_info_.min_length = header.min_length;
+  expr_info_.max_length = header.max_length;
+  for (std::size_t c = 0; c < 256; c++) expr_info_.involve[c] = header.involve[c];
+  prefilter_ = Prefilter();
+  Finalize();
+  minimum_ = true;
+  return true;
+}
+
+std::size_t DFA::memory_size() const
+{
+  std::size_t size = transition_.size() * sizeof(Transition)
+      + states_.size() * sizeof(State) + flat_table_.table.size();
+#if REGEN_ENABLE_XBYAK
+  if (xgen_ != NULL) size += xgen_->CodeSize();
+  if (jitter_ != NULL) size += jitter_->CodeSize();
+#endif
+  return size;
+}
+
+DFA::state_t DFA::Run(const Regen::StringPiece &string, state_t *state, const unsigned char **matchptr) const
+{
+  if (complete_) return *state = RunFrom(string, *state, matchptr);
+  Reader reader(*this);
+  return *state = RunFrom(string, *state, matchptr);
+}
+
+bool DFA::RunEnd(const state_t *state, bool begline) const
+{
+  if (complete_) return AcceptAtEnd(*state, begline);
+  Reader reader(*this);
+  return AcceptAtEnd(*state, begline);
+}
+
+/* run the DFA over `string' from `state', and return the state after its
+ * last byte (or REJECT). `matchptr', when given, is set after each accept
+ * state on the way. unlike Match() it never skips input, as the rest of a
+ * stream may still complete a match. */
+DFA::state_t DFA::RunFrom(const Regen::StringPiece &string, state_t state, const unsigned char **matchptr) const
+{
+  const unsigned char *p = string.ubegin(), *end = string.uend();
+  if (state == REJECT) return REJECT;
+  if (!complete_) {
+    OnTheFlyStart();
+    if (matchptr != NULL && IsAcceptState(state)) {
+      *matchptr = p;
+      if (flag_.shortest_match()) return state;
+    }
+    while (p != end) {
+      state_t next = transition_[state][*p];
+      if (next == UNDEF) next = OnTheFlyTransition(state, *p);
+      if ((state = next) == REJECT) break;
+      p++;
+      if (matchptr != NULL && IsAcceptState(state)) {
+        *matchptr = p;
+        if (flag_.shortest_match()) break;
+      }
+    }
+  } else if (olevel_ >= Regen::Options::O1 && reset_state_ == UNDEF) {
+    /* JIT-ed code has no keyword filter, it runs to the end. */
+    Regen::StringPiece string_(string);
+    const unsigned char *ptr = NULL;
+    state = CompiledMatch(string_._udata(), &ptr, state);
+    if (matchptr != NULL && ptr != NULL) *matchptr = ptr;
+  } else if (!flat_table_.empty()) {
+    const FlatTable &flat = flat_table_;
+    if (matchptr != NULL && IsAcceptState(state)) *matchptr = p;
+    state_t s = flat.to_flat[state];
+    switch (flat.entry_size) {
+      case sizeof(uint8_t):  s = FlatMatch<uint8_t>(flat, s, &p, end, 1, matchptr, flat.size + 1); break;
+      case sizeof(uint16_t): s = FlatMatch<uint16_t>(flat, s, &p, end, 1, matchptr, flat.size + 1); break;
+      default:               s = FlatMatch<uint32_t>(flat, s, &p, end, 1, matchptr, flat.size + 1); break;
+    }
+    state = s == flat.size ? REJECT : flat.from_flat[s];
+  } else {
+    if (matchptr != NULL && IsAcceptState(state)) *matchptr = p;
+    while (p != end) {
+      if ((state = transition_[state][*p]) == REJECT) break;
+      p++;
+      if (matchptr != NULL && IsAcceptState(state)) *matchptr = p;
+    }
+  }
+  return state;
+}
+
+/* run the DFA over the whole `string' and collect the ids of the matching
+ * patterns: those accepted at the end of input, and with partial matching
+ * those accepted anywhere on the way. */
+bool DFA::MatchSet(const Regen::StringPiece &string, std::vector<std::size_t> *ids) const
+{
+  std::vector<bool> matched(expr_info_.pattern_num, false);
+  const bool track = !flag_.suffix_match();
+  const unsigned char *p = string.ubegin(), *end = string.uend();
+  state_t state = start_state();
+
+  if (!complete_) {
+    Reader reader(*this);
+    OnTheFlyStart();
+    for (;;) {
+      if (track) {
+        const std::vector<std::size_t> &v = states_[state].ids;
+        for (std::size_t i = 0; i < v.size(); i++) matched[v[i]] = true;
+      }
+      if (p == end) break;
+      state_t next = transition_[state][*p];
+      if (next == UNDEF) next = OnTheFlyTransition(state, *p);
+      state = next;
+      if (state == REJECT) break;
+      p++;
+    }
+  } else if (olevel_ >= Regen::Options::O1) {
+    /* JIT-ed code returns at each accept state when tracking. */
+    Regen::StringPiece string_(string);
+    const unsigned char *matchptr = NULL;
+    for (;;) {
+      if (track && states_[state].accept) {
+        const std::vector<std::size_t> &v = states_[state].ids;
+        for (std::size_t i = 0; i < v.size(); i++) matched[v[i]] = true;
+        if (p == end) break;
+        state = transition_[state][*p++];
+        if (state == REJECT) break;
+        continue;
+      }
+      if (p == end) break;
+      string_.set_ubegin(p);
+      state = CompiledMatch(string_._udata(), &matchptr, state);
+      p = string_.ubegin();
+      if (state == REJECT) break;
+    }
+  } else {
+    const FlatTable &flat = flat_table_;
+    state_t s = flat.to_flat[state];
+    for (;;) {
+      if (track && s >= flat.accept_begin && s < flat.size) {
+        const std::vector<std::size_t> &v = states_[flat.from_flat[s]].ids;
+        for (std::size_t i = 0; i < v.size(); i++) matched[v[i]] = true;
+      }
+      if (p == end || s == flat.size) break;
+      switch (flat.entry_size) {
+        case sizeof(uint8_t):  s = FlatMatchAccept<uint8_t>(flat, s, &p, end); break;
+        case sizeof(uint16_t): s = FlatMatchAccept<uint16_t>(flat, s, &p, end); break;
+        default:               s = FlatMatchAccept<uint32_t>(flat, s, &p, end); break;
+      }
+    }
+    state = s == flat.size ? REJECT : flat.from_flat[s];
+  }
+
+  if (p == end && state != REJECT) {
+    if (string.empty()) {
+      /* the start state may accept more at the beginning of a line. */
+      Subset endstates = subsets_.Get(state);
+      ExpandStates(&endstates, true, true);
+      for (Subset::iterator iter = endstates.begin(); iter != endstates.end(); ++iter) {
+        if ((*iter)->type() == Expr::kEOP) matched[static_cast<EOP*>(*iter)->id()] = true;
+      }
+    }
+    const std::vector<std::size_t> &v = states_[state].end_ids;
+    for (std::size_t i = 0; i < v.size(); i++) matched[v[i]] = true;
+  }
+
+  ids->clear();
+  for (std::size_t i = 0; i < matched.size(); i++) {
+    if (matched[i]) ids->push_back(i);
+  }
+  return !ids->empty();
+}
+
+DFA::Reader::Reader(const DFA &dfa): dfa_(dfa)
+{
+#ifdef REGEN_ENABLE_PARALLEL
+  dfa_.cache_mutex_.lock_shared();
+#endif
+}
+
+DFA::Reader::~Reader()
+{
+#ifdef REGEN_ENABLE_PARALLEL
+  dfa_.cache_mutex_.unlock_shared();
+#endif
+}
+
+/* trade the shared lock for the exclusive one, and back. the states may
+ * be flushed in between, by this thread or another one. */
+void DFA::BeginUpdate() const
+{
+#ifdef REGEN_ENABLE_PARALLEL
+  cache_mutex_.unlock_shared();
+  cache_mutex_.lock();
+#endif
+}
+
+void DFA::EndUpdate() const
+{
+#ifdef REGEN_ENABLE_PARALLEL
+  cache_mutex_.unlock_and_lock_shared();
+#endif
+}
+
+/* same as FillTransition, for a single byte. */
+void DFA::NextSubset(state_t state, unsigned char c, Subset *nexts) const
 {
-  if (empty()) {
-    Subset states = expr_info_.expr_root->first();
-    ExpandStates(&states, true);
-    bool accept = ContainAcceptState(states);
-    State& s = get_new_state();
-    dfa_map_[states] = s.id;
-    nfa_map_[s.id] = states;
-    s.accept = accept;
+  const bool delimiter = c == flag_.delimiter() && !flag_.one_line();
+  for (StateExpr * const *iter = subsets_.begin(state); iter != subsets_.end(state); ++iter) {
+    StateExpr *s = *iter;
+    if (s->non_greedy()) MakeNonGreedy(s);
+    bool follow;
+    switch (s->type()) {
+      case Expr::kDot:    follow = !delimiter || static_cast<Dot*>(s)->match_delimiter(); break;
+      case Expr::kAnchor: follow = delimiter; break;
+      default:            follow = !delimiter && s->Match(c); break;
+    }
+    if (follow) nexts->insert(s->follow().begin(), s->follow().end());
   }
+  ExpandStates(nexts);
+  /* as in Construct(), so that the states it built and these agree. */
+  if (expr_info_.pattern_num == 0 && ContainAcceptState(*nexts)) TrimNonGreedy(nexts);
+}
+
+/* build (and cache) the transition of `state' on `c', under the shared
+ * lock. transitions to known states are filled in place, new states are
+ * added under the exclusive lock. */
+DFA::state_t DFA::OnTheFlyTransition(state_t state, unsigned char c) const
+{
+#ifdef REGEN_ENABLE_PARALLEL
+  {
+    boost::mutex::scoped_lock lock(build_mutex_);
+    state_t next = transition_[state][c];
+    if (next != UNDEF) return next;
+    Subset nexts;
+    NextSubset(state, c, &nexts);
+    next = nexts.empty() ? REJECT : subsets_.Find(nexts, SubsetTable::Hash(nexts));
+    /* a single word store, readers see either UNDEF or `next'. */
+    if (next != UNDEF) return transition_[state][c] = next;
+  }
+  const Subset current(subsets_.Get(state));
+  const std::size_t flush_num = flush_num_;
+  BeginUpdate();
+  if (flush_num != flush_num_) state = Intern(current);
+  const state_t next = Transit(state, c);
+  EndUpdate();
+  return next;
+#else
+  return Transit(state, c);
+#endif
+}
+
+/* OnTheFlyTransition, with the states all to itself. */
+DFA::state_t DFA::Transit(state_t state, unsigned char c) const
+{
+  if (transition_[state][c] != UNDEF) return transition_[state][c];
+  Subset nexts;
+  NextSubset(state, c, &nexts);
+
+  state_t next = REJECT;
+  if (!nexts.empty()) {
+    const std::size_t hash = SubsetTable::Hash(nexts);
+    next = subsets_.Find(nexts, hash);
+    if (next == UNDEF && flag_.state_budget() != 0 && size() >= flag_.state_budget()) {
+      state = Flush(state);
+      next = subsets_.Find(nexts, hash);
+    }
+    if (next == UNDEF) {
+      next = Intern(nexts);
+      built_num_++;
+    }
+  }
+  return transition_[state][c] = next;
+}
+
+/* the state of `subset', added if new. */
+DFA::state_t DFA::Intern(const Subset &subset) const
+{
+  const std::size_t hash = SubsetTable::Hash(subset);
+  state_t id = subsets_.Find(subset, hash);
+  if (id != UNDEF) return id;
+  bool accept = ContainAcceptState(subset);
+  State& s = get_new_state();
+  id = subsets_.Insert(subset, hash);
+  s.accept = accept;
+  if (expr_info_.pattern_num != 0) FillMatchIds(id);
+  return id;
+}
+
+/* the state budget is over: drop all the states, and build again the
+ * ones still in use, i.e. the start state, the reset state of the
+ * prefilter, the pinned states and `state'. returns the new `state'. */
+DFA::state_t DFA::Flush(state_t state) const
+{
+  std::vector<state_t *> keep(pinned_);
+  keep.push_back(&reset_state_);
+  keep.push_back(&state);
+  std::vector<Subset> subsets(1, subsets_.Get(start_state()));
+  for (std::size_t i = 0; i < keep.size(); i++) {
+    if (*keep[i] != REJECT && *keep[i] != UNDEF) subsets.push_back(subsets_.Get(*keep[i]));
+  }
+
+  transition_.clear();
+  states_.clear();
+  subsets_.clear();
+  std::vector<state_t> ids(subsets.size());
+  for (std::size_t i = 0; i < subsets.size(); i++) ids[i] = Intern(subsets[i]);
+  for (std::size_t i = 0, j = 1; i < keep.size(); i++) {
+    if (*keep[i] != REJECT && *keep[i] != UNDEF) *keep[i] = ids[j++];
+  }
+  flush_num_++;
+#if REGEN_ENABLE_XBYAK
+  if (jitter_ != NULL) jitter_->Flush();
+#endif
+  return state;
+}
+
+void DFA::Pin(state_t *state) const
+{
+#ifdef REGEN_ENABLE_PARALLEL
+  boost::unique_lock<boost::shared_mutex> lock(cache_mutex_);
+#endif
+  pinned_.push_back(state);
+}
+
+void DFA::Unpin(state_t *state) const
+{
+#ifdef REGEN_ENABLE_PARALLEL
+  boost::unique_lock<boost::shared_mutex> lock(cache_mutex_);
+#endif
+  std::vector<state_t *>::iterator iter = std::find(pinned_.begin(), pinned_.end(), state);
+  if (iter != pinned_.end()) pinned_.erase(iter);
+}
+
+/* create the start state for on-the-fly matching, and the reset state of
+ * the prefilter. called under the shared lock. */
+void DFA::OnTheFlyStart() const
+{
+  if (on_the_fly_) return;
+  BeginUpdate();
+  if (!on_the_fly_) {
+    if (empty()) {
+      Subset states = expr_info_.expr_root->first();
+      ExpandStates(&states, true);
+      if (expr_info_.pattern_num == 0 && ContainAcceptState(states)) TrimNonGreedy(&states);
+      subsets_.clear();
+      Intern(states);
+    }
+    if (reset_state_ == UNDEF && !prefilter_.empty()) {
+      for (std::size_t c = 0; c < 256; c++) {
+        if (!expr_info_.involve[c] && c != flag_.delimiter()) {
+          state_t reset = Transit(0, c);
+          if (reset != REJECT) reset_state_ = reset;
+          break;
+        }
+      }
+    }
+    on_the_fly_ = true;
+  }
+  EndUpdate();
+}
+
+bool DFA::OnTheFlyMatch(const Regen::StringPiece& string, Regen::StringPiece* result) const
+{
+  Reader reader(*this);
+  OnTheFlyStart();
 
   int dir = 1;  
   const unsigned char* str = string.ubegin();
   const unsigned char* end = string.uend();
+  const unsigned char *cache[2] = {NULL, NULL};
   if (flag_.reverse_match()) {
     dir = -1; str--, end--;
     std::swap(str, end);
   }
   
   state_t state = 0, next = UNDEF;
-  
+  const bool track = !flag_.suffix_match();
+  const unsigned char *matchptr = track && IsAcceptState(state) ? str : NULL;
+  bool accept = false;
+  if (matchptr != NULL && flag_.shortest_match()) end = str;
+
+#if REGEN_ENABLE_XBYAK
+  if (jitter_ != NULL && dir == 1 && reset_state_ == UNDEF) {
+    if (str != end) state = jitter_->Match(&str, end, state, track ? &matchptr : NULL);
+  } else
+#endif
   while (str != end) {
+    if (state == reset_state_) {
+      str = prefilter_.Candidate(str, end, cache);
+      if (str == end) { state = REJECT; break; }
+    }
     next = transition_[state][*str];
-    if (next >= UNDEF) {
-      if (next == REJECT) return false;
-      do { // do matching with on-the-fly construction.
-        Subset& states = nfa_map_[state];
-        Subset nexts;
-
-        for (Subset::iterator iter = states.begin(); iter != states.end(); ++iter) {
-          if ((*iter)->Match(*str)) {
-            nexts.insert((*iter)->follow().begin(), (*iter)->follow().end());
-          }
-        }
-        ExpandStates(&nexts);
-
-        if (nexts.empty()) {
-          next = transition_[state][*str] = REJECT;
-        } else if (dfa_map_.find(nexts) == dfa_map_.end()) {
-          bool accept = ContainAcceptState(nexts);
-          State& s = get_new_state();
-          dfa_map_[nexts] = s.id;
-          nfa_map_[s.id] = nexts;
-          s.accept = accept;
-          next = transition_[state][*str] = s.id;
-        } else {
-          next = dfa_map_[nexts];
-        }
-        str += dir;
-        state = next;
-      } while (str != end && transition_[state][*str] == UNDEF);
-    } else {
-      str += dir;
-      state = next;
+    if (next == UNDEF) next = OnTheFlyTransition(state, *str);
+    if ((state = next) == REJECT) break;
+    str += dir;
+    if (track && IsAcceptState(state)) {
+      matchptr = str;
+      /* on-the-fly states keep their transitions after accepting */
+      if (flag_.shortest_match()) break;
     }
   }
 
-  if (IsAcceptState(state)) return true;
-  if (str == end && state != REJECT) {
-    Subset endstates = nfa_map_[state];
-    ExpandStates(&endstates, str == string.ubegin(), true);
-    return ContainAcceptState(endstates);
+  if (str == end) {
+    accept = AcceptAtEnd(state, string.empty());
+  } else {
+    accept = IsAcceptState(state);
   }
-  return false;
+  if (result != NULL) {
+    if (flag_.suffix_match() && accept) {
+      if (flag_.reverse_match()) {
+        result->set_begin(string.begin());
+      } else {
+        result->set_end(string.end());
+      }
+    } else if (matchptr == NULL && accept) {
+      if (flag_.reverse_match()) {
+        result->set_begin(string.begin());
+      } else {
+        result->set_end(string.end());
+      }
+    } else if (matchptr != NULL) {
+      if (flag_.reverse_match()) {
+        result->set_ubegin(matchptr+1);
+      } else {
+        result->set_uend(matchptr);
+      }
+    }
+  }
+  return accept || matchptr != NULL;
 }
 
 } // namespace regen
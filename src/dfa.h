@@ -4,10 +4,14 @@
 #include "util.h"
 #include "nfa.h"
 #include "expr.h"
+#include "prefilter.h"
 #if REGEN_ENABLE_XBYAK
 #include "jitter.h"
 #include "ext/xbyak/xbyak.h"
 #include "ext/str_util.hpp"
+#ifdef REGEN_ENABLE_PARALLEL
+#include <boost/thread.hpp>
+#endif
 #endif
 
 namespace regen {
@@ -26,6 +30,10 @@ class JITCompiler: public Xbyak::CodeGenerator {
   std::vector<const uint8_t*> states_addr_;
   const uint8_t *filter_entry_;
   uint32_t reset_state_;
+  /* jump tables of large DFAs are indexed by byte class instead of byte. */
+  std::size_t table_width_;
+  uint8_t byte_class_[256];
+  static std::size_t table_width(const DFA &dfa);
   static std::size_t code_segment_size(std::size_t state_num) {
     const std::size_t setup_code_size_ = 16;
     const std::size_t state_code_size_ = 64;
@@ -33,9 +41,10 @@ class JITCompiler: public Xbyak::CodeGenerator {
     return (state_num*state_code_size_ + setup_code_size_)
         +  ((state_num*state_code_size_ + setup_code_size_) % segment_align);
   }
-  static std::size_t data_segment_size(std::size_t state_num) {
-    return state_num * 256 * sizeof(void *);
+  static std::size_t data_segment_size(std::size_t state_num, std::size_t width) {
+    return state_num * width * sizeof(void *);
   }
+  static const std::size_t MaxFullTableSize = 64 << 10;
 };
 #endif
 
@@ -70,21 +79,85 @@ public:
     std::set<state_t> src_states;
     AlterTrans alter_transition;
     std::size_t inline_level;
+    /* with several patterns: ids of the patterns accepted here, and at
+     * the end of input. sorted. */
+    std::vector<std::size_t> ids;
+    std::vector<std::size_t> end_ids;
     state_t &operator[](std::size_t index) { return (*transitions)[id][index]; }
     const state_t &operator[](std::size_t index) const { return (*transitions)[id][index]; }
   };
+  /* compact transition table for table driven (O0) matching.
+   * bytes are mapped to equivalence classes, accept states are renumbered
+   * into [accept_begin, size), `size' itself stands for REJECT, and each
+   * entry takes 1, 2 or 4 bytes depending on the number of states. */
+  struct FlatTable {
+    FlatTable(): class_num(0), entry_size(0), accept_begin(0), size(0) {}
+    unsigned char byte_class[256];
+    std::size_t class_num;
+    std::size_t entry_size;
+    state_t accept_begin;
+    state_t size;
+    std::vector<state_t> to_flat;
+    std::vector<state_t> from_flat;
+    std::vector<uint8_t> table;
+    bool empty() const { return table.empty(); }
+    void clear() { table.clear(); to_flat.clear(); from_flat.clear(); class_num = 0; }
+  };
+  /* interned NFA position sets. each distinct set is stored once, as a
+   * sorted array, and is found through its precomputed hash. the i-th
+   * interned set is the subset of DFA state i. */
+  class SubsetTable {
+   public:
+    SubsetTable(): buckets_(16, UNDEF) { offset_.push_back(0); }
+    std::size_t size() const { return hash_.size(); }
+    static std::size_t Hash(const Subset &subset);
+    state_t Find(const Subset &subset, std::size_t hash) const;
+    state_t Insert(const Subset &subset, std::size_t hash);
+    StateExpr * const *begin(state_t id) const { return elems_.empty() ? NULL : &elems_[0] + offset_[id]; }
+    StateExpr * const *end(state_t id) const { return elems_.empty() ? NULL : &elems_[0] + offset_[id+1]; }
+    Subset Get(state_t id) const { return Subset(begin(id), end(id)); }
+    /* keep only the sets `ids', renumbered in that order. */
+    void Compact(const std::vector<state_t> &ids);
+    void clear() { SubsetTable empty; Swap(&empty); }
+   private:
+    void Swap(SubsetTable *other);
+    void Rehash();
+    bool Equal(state_t id, const Subset &subset) const;
+    std::vector<StateExpr *> elems_;
+    std::vector<std::size_t> offset_;
+    std::vector<std::size_t> hash_;
+    std::vector<state_t> buckets_; // open addressing, power of 2 size
+  };
+  /* image of a complete DFA (Serialize), native endian, laid out as the
+   * header, one flag byte per state (1: accept, 2: accept at the end, 4:
+   * accept at the end of an empty input) padded to 4
+   * bytes, the transitions (state_num * 256 state_t) and the pattern. it
+   * is read back (Deserialize) with plain copies, e.g. from Util::mmap_t. */
+  struct ImageHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t parse_flag;
+    uint32_t delimiter;
+    uint32_t state_num;
+    uint64_t min_length;
+    uint64_t max_length;
+    uint64_t thread_num;
+    uint64_t pattern_size;
+    uint8_t involve[256];
+  };
+  static const uint32_t ImageVersion = 1;
   typedef std::deque<State>::iterator iterator;
   typedef std::deque<State>::const_iterator const_iterator;
 
-  DFA(const Regen::Options flag = Regen::Options::NoParseFlags): complete_(false), minimum_(false), flag_(flag), olevel_(Regen::Options::O0)
+  DFA(const Regen::Options flag = Regen::Options::NoParseFlags): reset_state_(UNDEF), accept_empty_(false), built_num_(0), flush_num_(0), on_the_fly_(false), complete_(false), minimum_(false), flag_(flag), olevel_(Regen::Options::O0)
 #ifdef REGEN_ENABLE_XBYAK
-  , xgen_(NULL)
+  , xgen_(NULL), jitter_(NULL)
 #endif
   {}
   DFA(const ExprInfo &expr_info, std::size_t limit = std::numeric_limits<size_t>::max());
   DFA(const NFA &nfa, std::size_t limit = std::numeric_limits<size_t>::max());
   #if REGEN_ENABLE_XBYAK
-  virtual ~DFA() { delete xgen_; }
+  virtual ~DFA() { delete xgen_; delete jitter_; }
   #else
   virtual ~DFA() { }
   #endif
@@ -97,7 +170,11 @@ public:
 
   State& get_new_state() const;
   const ExprInfo &expr_info() const { return expr_info_; }
-  void set_expr_info(const ExprInfo &expr_info) { expr_info_ = expr_info; }
+  void set_expr_info(const ExprInfo &expr_info);
+  /* FilteredMatch: when matching gets back to reset_state (no match in
+   * progress), it may skip ahead to prefilter().Candidate(). */
+  const Prefilter &prefilter() const { return prefilter_; }
+  state_t reset_state() const { return reset_state_; }
   const Regen::Options &flag() const { return flag_; }
   std::size_t inline_level(std::size_t i) const { return states_[i].inline_level; }
   const std::set<state_t> &src_states(std::size_t i) const { return states_[i].src_states; }
@@ -107,6 +184,10 @@ public:
   bool IsAcceptState(std::size_t state) const { return state == REJECT ? false : states_[state].accept; }
   bool IsEndlineState(std::size_t state) const { return state == REJECT ? false : states_[state].endline; }
   bool IsAcceptOrEndlineState(std::size_t state)  const { return IsAcceptState(state) | IsEndlineState(state); }
+  bool AcceptAtEnd(std::size_t state, bool begline = false) const;
+  const FlatTable &flat_table() const { return flat_table_; }
+  /* approximate memory of the tables and the JIT-ed code. */
+  std::size_t memory_size() const;
 
   bool ContainAcceptState(const Subset&) const;
   void ExpandStates(Subset*, bool begline = false, bool endline = false) const;
@@ -116,11 +197,31 @@ public:
 
   void Complementify();
   virtual bool Minimize();
-  bool Compile(Regen::Options::CompileFlag olevel = Regen::Options::O2);
+  virtual bool Compile(Regen::Options::CompileFlag olevel = Regen::Options::O2);
   virtual bool OnTheFlyMatch(const Regen::StringPiece& string, Regen::StringPiece* result = NULL) const;
+  state_t OnTheFlyTransition(state_t state, unsigned char c) const;
+  /* states built while matching, and flushes over the state budget
+   * (Regen::Options::state_budget). */
+  std::size_t built_num() const { return built_num_; }
+  std::size_t flush_num() const { return flush_num_; }
+  /* states held between matches (e.g. by Regen::Stream) are renumbered
+   * along with the kept ones on a flush. */
+  void Pin(state_t *state) const;
+  void Unpin(state_t *state) const;
   virtual bool Match(const Regen::StringPiece& string, Regen::StringPiece* result = NULL) const;
+  bool Match(const Regen::StringPiece& string, Regen::StringPiece* result, state_t state) const;
+  /* resumable run for streams (see Regen::Stream), without prefilter.
+   * `*state' is pinned, and read and written under the cache lock. */
+  state_t Run(const Regen::StringPiece& string, state_t *state, const unsigned char** matchptr) const;
+  bool RunEnd(const state_t *state, bool begline) const;
+  /* ids of the patterns (ExprInfo::pattern_num) matching `string'. */
+  bool MatchSet(const Regen::StringPiece& string, std::vector<std::size_t>* ids) const;
   void state2label(state_t state, char* labelbuf) const;
 
+  bool Serialize(const Regen::StringPiece& pattern, std::string* image) const;
+  bool Deserialize(const Regen::StringPiece& image);
+  static bool ReadImageHeader(const Regen::StringPiece& image, ImageHeader* header, Regen::StringPiece* pattern);
+
   bool Construct(std::size_t limit = std::numeric_limits<size_t>::max());
   bool Construct(const NFA &nfa, std::size_t limit = std::numeric_limits<size_t>::max());
   iterator begin() { return states_.begin(); }
@@ -134,14 +235,47 @@ public:
 protected:
   mutable std::vector<Transition> transition_;
   mutable std::deque<State> states_;
-  mutable std::map<Subset, state_t> dfa_map_;
-  mutable std::map<state_t, Subset> nfa_map_;
+  mutable SubsetTable subsets_;
   ExprInfo expr_info_;
+  Prefilter prefilter_;
+  mutable state_t reset_state_;
+  /* whether an empty input is accepted, for DFAs without subsets. */
+  bool accept_empty_;
+  mutable std::size_t built_num_;
+  mutable std::size_t flush_num_;
+  mutable std::vector<state_t *> pinned_;
+  mutable bool on_the_fly_;
+#ifdef REGEN_ENABLE_PARALLEL
+  /* the states built while matching are shared by all the threads: they
+   * are walked under the shared lock of cache_mutex_, transitions to
+   * known states are filled in under build_mutex_, and states are added
+   * or flushed under the exclusive lock. */
+  mutable boost::shared_mutex cache_mutex_;
+  mutable boost::mutex build_mutex_;
+#endif
+  class Reader {
+   public:
+    Reader(const DFA &dfa);
+    ~Reader();
+   private:
+    const DFA &dfa_;
+  };
+  void BeginUpdate() const;
+  void EndUpdate() const;
   mutable ExprPool pool_;
   mutable bool complete_;
   bool minimum_;
   Regen::Options flag_;
   void Finalize();
+  void Flatten();
+  void FillMatchIds(state_t state) const;
+  void OnTheFlyStart() const;
+  state_t RunFrom(const Regen::StringPiece& string, state_t state, const unsigned char** matchptr) const;
+  void NextSubset(state_t state, unsigned char c, Subset *nexts) const;
+  state_t Transit(state_t state, unsigned char c) const;
+  state_t Intern(const Subset &subset) const;
+  state_t Flush(state_t state) const;
+  FlatTable flat_table_;
   state_t (*CompiledMatch)(const unsigned char**, const unsigned char**, state_t);
   bool EliminateBranch();
   bool Reduce();
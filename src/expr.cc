@@ -198,11 +198,12 @@ top:
 
 void CharClass::FillKeywords(Keywords *key, std::bitset<256> *involve)
 {
-  *involve = table_;
-  if (negative_) involve->flip();
+  std::bitset<256> table = table_;
+  if (negative_) table.flip();
+  *involve |= table;
   if (key != NULL) {
     for (std::size_t i = 0; i < 256; i++) {
-      if (involve->test(i)) {
+      if (table.test(i)) {
         key->in.insert(std::string(1, i));
       }
     }
@@ -356,8 +357,15 @@ void Concat::FillKeywords(Keywords *key, std::bitset<256> *involve)
       key->in.erase(key_.left);
       key->in.insert(key->right+key_.left);
     }
+    /* either side's candidates cover the concatenation. */
+    if (key->candidates.empty() && !key_.candidates.empty()) {
+      key->candidates.swap(key_.candidates);
+      key->no_candidates = false;
+    }
 
-    key->right = key_.right;
+    /* a literal side extends the other side's prefix/suffix. */
+    if (key->is != "") key->left = key->is + key_.left;
+    key->right = key_.is != "" ? key->right + key_.is : key_.right;
     
     if (key->is != "" && key_.is != "") {
       key->is = key->right = key->left = key->is + key_.is;
@@ -441,9 +449,10 @@ void Union::FillKeywords(Keywords *key, std::bitset<256> *involve)
         key->no_candidates = true;
         key->candidates.clear();
       } else {
-        key->candidates.insert(key_.candidates.begin(), key_.candidates.end());
-        key->candidates.insert(key_.in.begin(), key_.in.end());
-        key->candidates.insert(key->in.begin(), key->in.end());
+        /* every match of either side contains one of its candidates. */
+        if (key->candidates.empty()) key->candidates = key->required();
+        const std::set<std::string> &rhs = key_.candidates.empty() ? key_.required() : key_.candidates;
+        key->candidates.insert(rhs.begin(), rhs.end());
         if (key->candidates.size() > 32) {
           key->no_candidates = true;
           key->candidates.clear();
@@ -560,8 +569,10 @@ void Intersection::Generate(std::set<std::string> &g, GenOpt opt, std::size_t n)
   Trim(g, opt, n);
 }
 
-void Intersection::FillKeywords(Keywords *key, std::bitset<256> *)
+void Intersection::FillKeywords(Keywords *key, std::bitset<256> *involve)
 {
+  rhs_->FillKeywords(NULL, involve);
+  lhs_->FillKeywords(NULL, involve);
 }
 
 XOR::XOR(Expr* lhs, Expr* rhs, ExprPool *p):
@@ -624,15 +635,17 @@ void XOR::Generate(std::set<std::string> &g, GenOpt opt, std::size_t n)
   Trim(g, opt, n);
 }
 
-void XOR::FillKeywords(Keywords *key, std::bitset<256> *)
+void XOR::FillKeywords(Keywords *key, std::bitset<256> *involve)
 {
+  rhs_->FillKeywords(NULL, involve);
+  lhs_->FillKeywords(NULL, involve);
 }
 
 void Qmark::FillPosition(ExprInfo *info)
 {
   lhs_->FillPosition(info);
   
-  max_length_ = lhs_->min_length();
+  max_length_ = lhs_->max_length();
   min_length_ = 0;
   nullable_ = true;
   first() = lhs_->first();
@@ -50,12 +50,48 @@ struct Keywords {
   std::set<std::string> in;
   std::set<std::string> candidates;
   const std::string& longest_keyword() const
-  { static const std::string empty; return in.empty() ? empty : *std::max_element(in.begin(), in.end(), compare_keywords); }
+  { static const std::string empty; return in.empty() ? empty : *std::min_element(in.begin(), in.end(), compare_keywords); }
+  /* strings one of which every match contains: the longest keyword if
+   * it is longer than a byte (single bytes may come from a class). */
+  std::set<std::string> required() const
+  { const std::string &k = longest_keyword(); return k.size() > 1 ? std::set<std::string>(&k, &k + 1) : in; }
   bool no_candidates;
 };
 
+/* partition of bytes into classes which no expression tells apart.
+ * starts from the identity (each byte is a class of its own). */
+struct ByteClass {
+  ByteClass(): num(256) { for (int c = 0; c < 256; c++) map[c] = rep[c] = c; }
+  unsigned char map[256]; // byte -> class
+  unsigned char rep[256]; // class -> its smallest byte
+  std::size_t num;
+  void Clear() { std::fill(map, map+256, 0); rep[0] = 0; num = 1; }
+  void Refine(const std::bitset<256> &set) {
+    int split[256][2];
+    std::fill(&split[0][0], &split[0][0] + 256*2, -1);
+    num = 0;
+    for (int c = 0; c < 256; c++) {
+      int &k = split[map[c]][set[c]];
+      if (k < 0) {
+        rep[num] = c;
+        k = num++;
+      }
+      map[c] = k;
+    }
+  }
+  void Refine(unsigned char c) { std::bitset<256> set; set.set(c); Refine(set); }
+};
+
+/* a bounded repetition X{n,m} (or (X?){m}, n = 0) of a single position
+ * X, expanded by the parser into the m clones of X in `positions'. */
+struct Counter {
+  std::size_t lower;
+  std::size_t upper;
+  std::vector<StateExpr*> positions;
+};
+
 struct ExprInfo {
-  ExprInfo(): xor_num(0), expr_root(NULL), orig_root(NULL), copied_root(NULL), extra_top(NULL), eop(NULL), min_length(0), max_length(0) {}
+  ExprInfo(): xor_num(0), expr_root(NULL), orig_root(NULL), copied_root(NULL), extra_top(NULL), eop(NULL), min_length(0), max_length(0), pattern_num(0) {}
   std::size_t xor_num;
   Expr *expr_root;
   Expr *orig_root;
@@ -64,8 +100,12 @@ struct ExprInfo {
   EOP *eop;
   std::size_t min_length;
   std::size_t max_length;
+  /* number of patterns told apart by EOP::id, 0 for a single regex. */
+  std::size_t pattern_num;
   std::bitset<256> involve;
   Keywords key;
+  ByteClass byte_class;
+  std::vector<Counter> counters;
 };
 
 struct Transition {
@@ -301,12 +341,16 @@ private:
 
 class EOP: public StateExpr {
 public:
-  EOP() { min_length_ = max_length_ = 0; nullable_ = true; }
+  EOP(std::size_t id = 0): id_(id) { min_length_ = max_length_ = 0; nullable_ = true; }
   ~EOP() {}
+  /* index of the pattern which ends here (see RegexSet). */
+  std::size_t id() const { return id_; }
+  void set_id(std::size_t id) { id_ = id; }
   Expr::Type type() { return Expr::kEOP; }  
   void Accept(ExprVisitor* visit) { visit->Visit(this); };
-  Expr* Clone(ExprPool *p) { return p->alloc<EOP>(); };
+  Expr* Clone(ExprPool *p) { return p->alloc<EOP>(id_); };
 private:
+  std::size_t id_;
   DISALLOW_COPY_AND_ASSIGN(EOP);
 };
 
@@ -444,6 +488,7 @@ public:
   void FillTransition();
   void FillKeywords(Keywords *, std::bitset<256> *);
   Expr::Type type() { return Expr::kQmark; }
+  bool non_greedy() { return non_greedy_; }
   void Accept(ExprVisitor* visit) { visit->Visit(this); };
   Expr* Clone(ExprPool *p) { return p->alloc<Qmark>(lhs_->Clone(p), non_greedy_, probability_); };
   void Serialize(std::vector<Expr*> &v, ExprPool *p) { v.push_back(p->alloc<Epsilon>()); lhs_->Serialize(v, p); }
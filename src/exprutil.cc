@@ -171,6 +171,28 @@ void DumpExprVisitor::Visit(BinaryExpr* e)
   e->rhs()->Accept(this);
 }
 
+void ByteClassVisitor::Visit(Literal* e)
+{
+  byte_class_->Refine((unsigned char)e->literal());
+}
+
+void ByteClassVisitor::Visit(CharClass* e)
+{
+  std::bitset<256> set;
+  for (std::size_t c = 0; c < 256; c++) {
+    if (e->Involve(c)) set.set(c);
+  }
+  byte_class_->Refine(set);
+}
+
+/* split `byte_class' so that every Literal and CharClass of `e' is a union
+ * of classes. */
+void ByteClassVisitor::Fill(Expr* e, ByteClass *byte_class)
+{
+  ByteClassVisitor self(byte_class);
+  e->Accept(&self);
+}
+
 void DumpExprVisitor::Dump(Expr* e)
 {
   static DumpExprVisitor self;
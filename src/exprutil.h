@@ -58,6 +58,19 @@ private:
   DumpExprVisitor() {}
 };
 
+class ByteClassVisitor: public ExprVisitor {
+public:
+  void Visit(Expr *e) {}
+  void Visit(Literal *e);
+  void Visit(CharClass *e);
+  void Visit(UnaryExpr* e) { e->lhs()->Accept(this); }
+  void Visit(BinaryExpr* e) { e->lhs()->Accept(this); e->rhs()->Accept(this); }
+  static void Fill(Expr *e, ByteClass *byte_class);
+private:
+  ByteClassVisitor(ByteClass *byte_class): byte_class_(byte_class) {}
+  ByteClass *byte_class_;
+};
+
 } // namespace regen
 
 #endif /* REGEN_EXPRUTIL_H_ */
@@ -12,6 +12,12 @@
 #include <xbyak/xbyak.h>
 #include <xbyak/xbyak_util.h>
 
+#ifdef STR_UTIL_VERBOSE
+	#define STR_UTIL_PRINT_SIZE(name, size) printf("%s size=%d\n", name, (int)(size))
+#else
+	#define STR_UTIL_PRINT_SIZE(name, size)
+#endif
+
 namespace str_util_impl {
 
 const size_t strstrOffset = 0;
@@ -38,41 +44,41 @@ struct StringCode : Xbyak::CodeGenerator {
 		const bool isSandyBridge = cpu.has(Xbyak::util::Cpu::tAVX);
 
 		gen_strstr(isSandyBridge);
-		printf("strstr size=%d\n", (int)getSize());
+		STR_UTIL_PRINT_SIZE("strstr", (int)getSize());
 
 		nextOffset(strlenOffset);
 		gen_strlen();
-		printf("strlen size=%d\n", (int)(getSize() - strlenOffset));
+		STR_UTIL_PRINT_SIZE("strlen", (int)(getSize() - strlenOffset));
 
 		nextOffset(strchrOffset);
 		gen_strchr(M_one);
-		printf("strchr size=%d\n", (int)(getSize() - strchrOffset));
+		STR_UTIL_PRINT_SIZE("strchr", (int)(getSize() - strchrOffset));
 
 		nextOffset(strchr_anyOffset);
 		gen_strchr(M_any);
-		printf("strchr_any size=%d\n", (int)(getSize() - strchr_anyOffset));
+		STR_UTIL_PRINT_SIZE("strchr_any", (int)(getSize() - strchr_anyOffset));
 
 		nextOffset(strchr_rangeOffset);
 		gen_strchr(M_range);
-		printf("strchr_range size=%d\n", (int)(getSize() - strchr_rangeOffset));
+		STR_UTIL_PRINT_SIZE("strchr_range", (int)(getSize() - strchr_rangeOffset));
 
 		nextOffset(findCharOffset);
 		gen_findChar(M_one);
-		printf("findChar size=%d\n", (int)(getSize() - findCharOffset));
+		STR_UTIL_PRINT_SIZE("findChar", (int)(getSize() - findCharOffset));
 
 		nextOffset(findChar_anyOffset);
 		gen_findChar(M_any);
-		printf("findChar_any size=%d\n", (int)(getSize() - findChar_anyOffset));
+		STR_UTIL_PRINT_SIZE("findChar_any", (int)(getSize() - findChar_anyOffset));
 
 		nextOffset(findChar_rangeOffset);
 		gen_findChar(M_range);
-		printf("findChar_range size=%d\n", (int)(getSize() - findChar_rangeOffset));
+		STR_UTIL_PRINT_SIZE("findChar_range", (int)(getSize() - findChar_rangeOffset));
 
 		nextOffset(findStrOffset);
 		gen_findStr(isSandyBridge);
-		printf("findStr size=%d\n", (int)(getSize() - findStrOffset));
+		STR_UTIL_PRINT_SIZE("findStr", (int)(getSize() - findStrOffset));
 	} catch (Xbyak::Error err) {
-		printf("ERR:%s(%d)\n", Xbyak::ConvertErrorToString(err), err);
+		fprintf(stderr, "ERR:%s(%d)\n", Xbyak::ConvertErrorToString(err), err);
 		::exit(1);
 	}
 private:
@@ -54,30 +54,71 @@ void DotGenerate(const DFA &dfa)
   puts("}");
 }
 
+/* prints a self-contained C matcher: byte class and transition tables,
+ * and `int match(const char *str, size_t len)' (renamed by defining
+ * REGEN_MATCH) which returns 1 when the input matches, like Regen::Match. */
 void CGenerate(const DFA &dfa)
 {
-  puts("typedef unsigned char  UCHAR;");
-  puts("typedef unsigned char *UCHARP;");
-  for (std::size_t i = 0; i < dfa.size(); i++) {
+  if (!dfa.Complete() || dfa.empty()) exitmsg("DFA is not complete (too many states?)\n");
+  const std::size_t state_num = dfa.size();
+
+  /* bytes which lead to the same state from every state share a class. */
+  std::vector<std::size_t> byte_class(256);
+  std::vector<unsigned int> represent;
+  std::map<std::vector<DFA::state_t>, std::size_t> classes;
+  for (unsigned int c = 0; c < 256; c++) {
+    std::vector<DFA::state_t> column(state_num);
+    for (std::size_t i = 0; i < state_num; i++) column[i] = dfa.GetTransition(i)[c];
+    std::map<std::vector<DFA::state_t>, std::size_t>::iterator iter = classes.find(column);
+    if (iter == classes.end()) {
+      iter = classes.insert(std::make_pair(column, classes.size())).first;
+      represent.push_back(c);
+    }
+    byte_class[c] = iter->second;
+  }
+  const std::size_t class_num = represent.size();
+  const char *entry = state_num < 0xff ? "unsigned char" : state_num < 0xffff ? "unsigned short" : "unsigned int";
+  const bool suffix_match = dfa.flag().suffix_match();
+
+  printf("/* DFA based matcher generated by recon: %" PRIuS " states, %" PRIuS " byte classes. */\n",
+         state_num, class_num);
+  puts("#include <stddef.h>\n");
+  puts("#ifndef REGEN_MATCH\n#define REGEN_MATCH match\n#endif\n");
+  printf("static const unsigned char regen_byte_class[256] = {");
+  for (std::size_t c = 0; c < 256; c++) {
+    printf("%s%" PRIuS "%s", c % 16 == 0 ? "\n  " : " ", byte_class[c], c < 255 ? "," : "\n};\n\n");
+  }
+  printf("/* next state by state and byte class, %" PRIuS " stands for reject. */\n", state_num);
+  printf("static const %s regen_transition[%" PRIuS "][%" PRIuS "] = {\n", entry, state_num, class_num);
+  for (std::size_t i = 0; i < state_num; i++) {
     const DFA::Transition &transition = dfa.GetTransition(i);
-    printf("void s%"PRIuS"(UCHARP beg, UCHARP buf, UCHARP end)\n{\n", i);
-    if (dfa.IsAcceptOrEndlineState(i)) {
-      puts("  return accept(beg, buf, end);");
-    } else {
-      printf("  static void (*table[256])(UCHARP, UCHARP, UCHARP) = { \n  ");
-      for (int j = 0; j < 256; j++) {
-        if (transition[j] == DFA::REJECT) {
-          printf("reject");
-        } else {
-          printf("s%d", transition[j]);
-        }
-        if (j < 255) printf(", ");
-      }
-      puts("  };");
-      puts("  return table[*buf++](beg, buf, end);");
+    printf("  {");
+    for (std::size_t k = 0; k < class_num; k++) {
+      DFA::state_t next = transition[represent[k]];
+      printf("%" PRIuS "%s", next == DFA::REJECT ? state_num : (std::size_t)next, k + 1 < class_num ? ", " : "");
     }
-    puts("}");
-  }  
+    printf("}%s\n", i + 1 < state_num ? "," : "");
+  }
+  puts("};\n");
+  puts("/* bit 0: accept state, bit 1: accepts at the end of the input. */");
+  printf("static const unsigned char regen_accept[%" PRIuS "] = {", state_num);
+  for (std::size_t i = 0; i < state_num; i++) {
+    printf("%s%d%s", i % 16 == 0 ? "\n  " : " ",
+           (dfa.IsAcceptState(i) ? 1 : 0) | (dfa.AcceptAtEnd(i) ? 2 : 0), i + 1 < state_num ? "," : "\n};\n\n");
+  }
+
+  puts("int REGEN_MATCH(const char *str, size_t len)\n{");
+  puts("  const unsigned char *p = (const unsigned char *)str, *end = p + len;");
+  puts("  unsigned int state = 0;");
+  printf("  if (len == 0) return %d;\n", dfa.AcceptAtEnd(dfa.start_state(), true) ? 1 : 0);
+  if (!suffix_match) puts("  if (regen_accept[0] & 1) return 1;");
+  puts("  for (; p != end; p++) {");
+  puts("    state = regen_transition[state][regen_byte_class[*p]];");
+  printf("    if (state == %" PRIuS ") return 0;\n", state_num);
+  if (!suffix_match) puts("    if (regen_accept[state] & 1) return 1;");
+  puts("  }");
+  puts("  return (regen_accept[state] & 2) != 0;");
+  puts("}");
 }
 
 } // namespace Generator
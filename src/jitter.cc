@@ -6,59 +6,94 @@ namespace regen {
 CodeSegment::CodeSegment(const DFA &dfa, Jitter &jitter, std::size_t code_segment_size):
     CodeGenerator(code_segment_size),
     dfa_(dfa), jitter_(jitter), code_segment_size_(code_segment_size),
-    reject_addr_(NULL), return_addr_(NULL),
+    reject_addr_(NULL), miss_addr_(NULL),
 #ifdef XBYAK32
     arg1(ecx), arg2(edx), arg3(ebx),
     tbl (ebp), tmp1(esi), tmp2(edi), reg_a(eax)
 #elif defined(XBYAK64_WIN)
     arg1(rcx), arg2(rdx), arg3(r8),
-    tbl (r9), tmp1(r10), tmp2(r11), reg_a(rax),
+    tbl (r9), tmp1(r10), tmp2(r11), reg_a(rax)
 #else
     arg1(rdi), arg2(rsi), arg3(rdx),
     tbl (r8), tmp1(r10), tmp2(r11), reg_a(rax)
 #endif
 {
+  EmitStubs();
 }
 
-const void* CodeSegment::EmitFunc()
+/* arg1: current pointer, arg2: end of the input, tmp2: last match (or 0),
+ * reg_a: current state. the stack holds `matchptr' and `str' of the entry.
+ *   return: write back the pointer and the last match.
+ *   reject: the next state is REJECT.
+ *   miss  : the transition is not known yet. the state code has already
+ *           stepped over the byte, so step back for Jitter::Match(). */
+void CodeSegment::EmitStubs()
 {
-  const void* func_ptr = getCurr();
-#ifdef XBYAK32
-  push(esi);
-  push(edi);
-  push(ebp);
-  push(ebx);
-  const int P_ = 4 * 4;
-  mov(arg1, ptr [esp + P_ + 4]);
-  mov(arg2, ptr [esp + P_ + 8]);
-  mov(arg3, ptr [esp + P_ + 12]);
-#endif
-  mov(tmp2, 0);
-  jmp("s0");
-  L("reject");
-  reject_addr_ = getCurr();
-  mov(reg_a, DFA::REJECT); // return false
+#ifndef XBYAK32
   L("return");
-  return_addr_ = getCurr();
-  cmp(arg3, 0);
-  je("finalize");
-  mov(ptr[arg3+sizeof(uint8_t*)], tmp2);
-  L("finalize");
-#ifdef XBYAK32
-  pop(ebx);
-  pop(ebp);
-  pop(edi);
-  pop(esi);
-#endif
+  pop(arg3);
+  test(tmp2, tmp2);
+  je("return_nomatch");
+  mov(ptr[arg3], tmp2);
+  L("return_nomatch");
+  pop(arg3);
+  mov(ptr[arg3], arg1);
   ret();
   align(16);
+  reject_addr_ = getCurr();
+  mov(eax, DFA::REJECT);
+  jmp("return", T_NEAR);
+  align(16);
+  miss_addr_ = getCurr();
+  dec(arg1);
+  jmp("return", T_NEAR);
+  align(16);
+#endif
+}
 
+/* state_t entry(const unsigned char **str, const unsigned char *end,
+ *               const unsigned char **matchptr, const void *code) */
+const void* CodeSegment::EmitFunc()
+{
+  const void* func_ptr = getCurr();
+#ifndef XBYAK32
+#ifdef XBYAK64_WIN
+  const Xbyak::Reg64 &code = r9;
+#else
+  const Xbyak::Reg64 &code = rcx;
+#endif
+  push(arg1);
+  push(arg3);
+  mov(arg1, ptr[arg1]);
+  xor(r11d, r11d);
+  jmp(code);
+  align(16);
+#endif
   return func_ptr;
 }
 
-const void* CodeSegment::EmitState(std::size_t state)
+/* entering a state records the match (and stops there for the shortest
+ * match), then steps through the jump table of the state. */
+const void* CodeSegment::EmitState(std::size_t state, const void *table)
 {
   const void* state_ptr = getCurr();
+#ifndef XBYAK32
+  if (dfa_.IsAcceptState(state) && !dfa_.flag().suffix_match()) {
+    mov(tmp2, arg1);
+    if (dfa_.flag().shortest_match()) {
+      mov(eax, (uint32_t)state);
+      jmp("return", T_NEAR);
+      return state_ptr;
+    }
+  }
+  mov(eax, (uint32_t)state);
+  cmp(arg1, arg2);
+  je("return", T_NEAR);
+  movzx(r10d, byte[arg1]);
+  inc(arg1);
+  mov(tbl, (uint64_t)table);
+  jmp(ptr[tbl + tmp1 * 8]);
+#endif
   return state_ptr;
 }
 
@@ -68,4 +103,91 @@ void Jitter::Init()
   func_ptr_ = CS()->EmitFunc();
 }
 
+void Jitter::Clear()
+{
+  for (std::vector<CodeSegment *>::iterator i = code_segments_.begin(); i != code_segments_.end(); ++i) delete *i;
+  code_segments_.clear();
+  data_segment_.clear();
+  code_.clear();
+  tables_.clear();
+}
+
+void Jitter::Flush()
+{
+  Clear();
+  Init();
+}
+
+std::size_t Jitter::CodeSize() const
+{
+  std::size_t size = data_segment_.size() * sizeof(Transition);
+  for (std::size_t i = 0; i < code_segments_.size(); i++) {
+    size += code_segments_[i]->getSize();
+  }
+  return size;
+}
+
+const void *Jitter::Code(state_t state)
+{
+  if (state >= code_.size()) {
+    code_.resize(state+1, NULL);
+    tables_.resize(state+1, NULL);
+  }
+  if (code_[state] == NULL) {
+    if (CS()->Full()) NewCS();
+    data_segment_.push_back(Transition(CS()->miss_addr_));
+    Transition *table = &data_segment_.back();
+    const DFA::Transition &trans = dfa_.GetTransition(state);
+    for (std::size_t c = 0; c < 256; c++) {
+      if (trans[c] == DFA::REJECT) (*table)[c] = CS()->reject_addr_;
+    }
+    tables_[state] = table;
+    code_[state] = CS()->EmitState(state, table->t);
+  }
+  return code_[state];
+}
+
+Jitter::state_t Jitter::Match(const unsigned char **str, const unsigned char *end,
+                              state_t state, const unsigned char **matchptr)
+{
+  typedef state_t (*Entry)(const unsigned char **, const unsigned char *,
+                           const unsigned char **, const void *);
+  const unsigned char *p = *str, *match = NULL;
+  for (;;) {
+    const void *code, *entry;
+    {
+#ifdef REGEN_ENABLE_PARALLEL
+      boost::mutex::scoped_lock lock(mutex_);
+#endif
+      code = Code(state);
+      entry = func_ptr_;
+    }
+    state = ((Entry)entry)(&p, end, &match, code);
+    if (state == DFA::REJECT || p == end) break;
+    if (dfa_.flag().shortest_match() && match != NULL) break;
+    /* miss: build the transition on *p and patch the slot, unless the
+     * DFA flushed its states (and this code) meanwhile. */
+    const std::size_t flush_num = dfa_.flush_num();
+    state_t next = dfa_.GetTransition(state)[*p];
+    if (next == DFA::UNDEF) next = dfa_.OnTheFlyTransition(state, *p);
+    const bool patch = flush_num == dfa_.flush_num();
+#ifdef REGEN_ENABLE_PARALLEL
+    boost::mutex::scoped_lock lock(mutex_);
+#endif
+    if (next == DFA::REJECT) {
+      if (patch) (*tables_[state])[*p] = CS()->reject_addr_;
+      state = next;
+      break;
+    }
+    /* an aligned pointer store, other threads jump to either code. */
+    const void *next_code = Code(next);
+    if (patch) (*tables_[state])[*p] = next_code;
+    state = next;
+    p++;
+  }
+  *str = p;
+  if (matchptr != NULL && match != NULL) *matchptr = match;
+  return state;
+}
+
 } // namespace regen
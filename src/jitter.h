@@ -3,24 +3,32 @@
 
 #include <vector>
 #include <list>
+#include "util.h"
 #include "xbyak/xbyak.h"
+#ifdef REGEN_ENABLE_PARALLEL
+#include <boost/thread.hpp>
+#endif
 
 namespace regen {
 
 class Jitter;
 class DFA;
-  
+
+/* code of the states found so far. every segment starts with its own
+ * return, reject and miss stubs, the first one also with the entry. */
 class CodeSegment: public Xbyak::CodeGenerator {
 public:
   CodeSegment(const DFA &dfa, Jitter &jitter, std::size_t code_segment_size);
   const void* EmitFunc();
-  const void* EmitState(std::size_t state);
+  const void* EmitState(std::size_t state, const void *table);
+  bool Full() const { return getSize() + MaxStateCodeSize > code_segment_size_; }
   const DFA &dfa_;
   Jitter &jitter_;
   std::size_t CodeSegmentSize() { return code_segment_size_; };
   std::size_t code_segment_size_;
   const void *reject_addr_;
-  const void *return_addr_;
+  const void *miss_addr_;
+  static const std::size_t MaxStateCodeSize = 96;
 #ifdef XBYAK32
   const Xbyak::Reg32& arg1;
   const Xbyak::Reg32& arg2;
@@ -38,35 +46,55 @@ public:
   const Xbyak::Reg64& tmp2;
   const Xbyak::Reg64& reg_a;
 #endif
+ private:
+  void EmitStubs();
 };
 
+/* incremental JIT for DFAs built on the fly, whose states are too many
+ * to be built (and compiled by JITCompiler) beforehand. a state gets its
+ * code when matching first reaches it. its jump table slots point at the
+ * miss stub until the transition is known: the stub returns to Match(),
+ * which builds the transition (DFA::OnTheFlyTransition), backpatches the
+ * slot with the code of the next state (or reject), and goes on. it runs
+ * under the shared lock of the DFA states, which it flushes (Flush())
+ * under the exclusive one.
+ * 64 bit only, forward matching only. */
 class Jitter {
 public:
+  typedef uint32_t state_t;
   struct Transition {
-    void* t[256];
-    Transition(void* fill = NULL) { std::fill(t, t+256, fill); }
-    void* &operator[](std::size_t index) { return t[index]; }
+    const void* t[256];
+    Transition(const void* fill = NULL) { std::fill(t, t+256, fill); }
+    const void* &operator[](std::size_t index) { return t[index]; }
   };
-  struct StateInfo {
-    StateInfo(Transition &t): addr(NULL), transition(t) {}
-    const void *addr;
-    Transition &transition;
-  };
-  Jitter(const DFA &dfa, std::size_t code_segment_size = 4096): dfa_(dfa), code_segment_size_(code_segment_size), func_ptr_(NULL)  {}
-  ~Jitter() { for (std::vector<CodeSegment *>::iterator i = code_segments_.begin(); i != code_segments_.end(); ++i) delete *i; }
+  Jitter(const DFA &dfa, std::size_t code_segment_size = 64 << 10): dfa_(dfa), code_segment_size_(code_segment_size), func_ptr_(NULL)  {}
+  ~Jitter() { Clear(); }
 
   CodeSegment * CS() { return code_segments_.back(); }
   CodeSegment * NewCS() { code_segments_.push_back(0); code_segments_.back() = new CodeSegment(dfa_, *this, code_segment_size_); return code_segments_.back(); }
-  StateInfo &state_info(std::size_t state) { return state_info_[state]; }
   void Init();
+  /* drops the code of all the states, when the DFA flushes them. */
+  void Flush();
+  /* runs from `state' over [*str, end) like the DFA::OnTheFlyMatch loop:
+   * returns the last state (or REJECT), with *str where it stopped, and
+   * sets *matchptr after accept states when it is given. */
+  state_t Match(const unsigned char **str, const unsigned char *end, state_t state,
+                const unsigned char **matchptr);
+  std::size_t CodeSize() const;
 private:
+  const void *Code(state_t state);
+  void Clear();
   const DFA &dfa_;
   std::size_t code_segment_size_;
   std::vector<CodeSegment *> code_segments_;
   std::list<Transition> data_segment_;
-  std::vector<StateInfo> state_info_;
-  std::size_t state_num_;
+  std::vector<const void *> code_;
+  std::vector<Transition *> tables_;
   const void *func_ptr_;
+#ifdef REGEN_ENABLE_PARALLEL
+  /* the code is shared by the threads matching with the DFA. */
+  boost::mutex mutex_;
+#endif
 };
 
 } // namespace regen
@@ -0,0 +1,287 @@
+#include "prefilter.h"
+#ifdef REGEN_ENABLE_XBYAK
+#include "ext/str_util.hpp"
+#endif
+
+namespace regen {
+
+#if defined(REGEN_ENABLE_XBYAK) && !defined(XBYAK32)
+namespace {
+
+/* Teddy inner loop: scans `blocks' 16 byte blocks from p (reading one
+ * byte past each block) and returns the first position whose two bytes
+ * hit the same bit of the nibble masks, or NULL. */
+class TeddyCode: public Xbyak::CodeGenerator {
+ public:
+  typedef const unsigned char *(*Scan)(const unsigned char *p, std::size_t blocks, const uint8_t *mask);
+  TeddyCode(): scan(NULL) {
+    const Xbyak::util::Cpu cpu;
+    if (!cpu.has(Xbyak::util::Cpu::tSSSE3)) return;
+#ifdef XBYAK64_WIN
+    const Xbyak::Reg64 &p(rcx), &blocks(rdx), &mask(r8);
+#else
+    const Xbyak::Reg64 &p(rdi), &blocks(rsi), &mask(rdx);
+#endif
+    mov(eax, 0x0f0f0f0f);
+    movd(xmm3, eax);
+    pshufd(xmm3, xmm3, 0);
+    test(blocks, blocks);
+    jz("notfound");
+    L("loop");
+    for (int i = 0; i < 2; i++) {
+      movdqu(xmm0, ptr[p+i]);
+      movdqa(xmm1, xmm0);
+      psrlw(xmm1, 4);
+      pand(xmm0, xmm3);
+      pand(xmm1, xmm3);
+      movdqu(xmm4, ptr[mask+32*i]);
+      pshufb(xmm4, xmm0);
+      movdqu(xmm5, ptr[mask+32*i+16]);
+      pshufb(xmm5, xmm1);
+      pand(xmm4, xmm5);
+      if (i == 0) movdqa(xmm2, xmm4);
+      else pand(xmm2, xmm4);
+    }
+    pxor(xmm4, xmm4);
+    pcmpeqb(xmm2, xmm4);
+    pmovmskb(eax, xmm2);
+    xor(eax, 0xffff);
+    jnz("found");
+    add(p, 16);
+    dec(blocks);
+    jnz("loop");
+    L("notfound");
+    mov(rax, 0);
+    ret();
+    L("found");
+    bsf(eax, eax);
+    add(rax, p);
+    ret();
+    scan = (Scan)getCode();
+  }
+  Scan scan;
+};
+
+TeddyCode::Scan teddy_scan()
+{
+  static TeddyCode code;
+  return code.scan;
+}
+
+} // namespace
+#endif
+
+Prefilter::Prefilter(const ExprInfo &info, const Regen::Options &flag):
+    key_size_(0), max_length_(info.max_length), delimiter_(flag.delimiter()),
+    min_key_size_(0), teddy_(false), ac_class_num_(0)
+{
+  if (!flag.filtered_match() || flag.reverse_match()) return;
+  const Keywords &key = info.key;
+  const std::string &keyword = key.longest_keyword();
+  if (keyword.length() > 1) {
+    key_size_ = std::min(keyword.length(), MaxKeywordSize);
+    std::fill(key_, key_ + sizeof(key_), 0);
+    std::copy(keyword.begin(), keyword.begin() + key_size_, key_);
+  } else if (!key.no_candidates && !key.candidates.empty()) {
+    /* a prefix of a keyword is as good a keyword. */
+    std::set<std::string> keys;
+    for (std::set<std::string>::const_iterator i = key.candidates.begin();
+         i != key.candidates.end(); ++i) {
+      if (i->length() < 2) return;
+      keys.insert(i->substr(0, MaxKeywordSize));
+    }
+    keys_.assign(keys.begin(), keys.end());
+    min_key_size_ = MaxKeywordSize;
+    for (std::size_t i = 0; i < keys_.size(); i++) {
+      min_key_size_ = std::min(min_key_size_, keys_[i].length());
+    }
+#if defined(REGEN_ENABLE_XBYAK) && !defined(XBYAK32)
+    teddy_ = keys_.size() <= TeddyMaxKeywords && teddy_scan() != NULL;
+#endif
+    if (teddy_) {
+      std::fill(&teddy_mask_[0][0], &teddy_mask_[0][0] + sizeof(teddy_mask_), 0);
+      for (std::size_t i = 0; i < keys_.size(); i++) {
+        for (std::size_t j = 0; j < 2; j++) {
+          unsigned char c = keys_[i][j];
+          teddy_mask_[j*2][c & 15] |= 1 << i;
+          teddy_mask_[j*2+1][c >> 4] |= 1 << i;
+        }
+      }
+    } else {
+      BuildAhoCorasick();
+    }
+  } else {
+    return;
+  }
+  for (std::size_t i = 0; i < 256; i++) {
+    involve_[i] = info.involve[i] || i == flag.delimiter();
+  }
+}
+
+void Prefilter::BuildAhoCorasick()
+{
+  std::fill(ac_class_, ac_class_ + 256, 0);
+  ac_class_num_ = 1;
+  for (std::size_t i = 0; i < keys_.size(); i++) {
+    for (std::size_t j = 0; j < keys_[i].length(); j++) {
+      unsigned char c = keys_[i][j];
+      if (ac_class_[c] == 0) ac_class_[c] = ac_class_num_++;
+    }
+  }
+  const std::size_t n = ac_class_num_;
+
+  /* trie, 0 (the root) stands for no transition. */
+  ac_transition_.assign(n, 0);
+  ac_output_.assign(1, 0);
+  for (std::size_t i = 0; i < keys_.size(); i++) {
+    uint32_t state = 0;
+    for (std::size_t j = 0; j < keys_[i].length(); j++) {
+      std::size_t index = state * n + ac_class_[(unsigned char)keys_[i][j]];
+      if (ac_transition_[index] == 0) {
+        ac_transition_[index] = ac_output_.size();
+        ac_transition_.resize(ac_transition_.size() + n, 0);
+        ac_output_.push_back(0);
+      }
+      state = ac_transition_[index];
+    }
+    ac_output_[state] = std::max<std::size_t>(ac_output_[state], keys_[i].length());
+  }
+
+  for (std::size_t c = 0; c < 256; c++) {
+    ac_start_[c] = ac_transition_[ac_class_[c]] != 0;
+  }
+
+  /* resolve failure links in breadth first order. */
+  std::vector<uint32_t> fail(ac_output_.size(), 0);
+  std::deque<uint32_t> queue;
+  for (std::size_t c = 0; c < n; c++) {
+    if (ac_transition_[c] != 0) queue.push_back(ac_transition_[c]);
+  }
+  while (!queue.empty()) {
+    uint32_t state = queue.front();
+    queue.pop_front();
+    ac_output_[state] = std::max(ac_output_[state], ac_output_[fail[state]]);
+    for (std::size_t c = 0; c < n; c++) {
+      uint32_t &next = ac_transition_[state * n + c];
+      if (next != 0) {
+        fail[next] = ac_transition_[fail[state] * n + c];
+        queue.push_back(next);
+      } else {
+        next = ac_transition_[fail[state] * n + c];
+      }
+    }
+  }
+}
+
+const unsigned char *Prefilter::Find(const unsigned char *begin, const unsigned char *end,
+                                     std::size_t *anchor) const
+{
+  if (key_size_ != 0) {
+    *anchor = key_size_;
+    return FindKeyword(begin, end);
+  } else if (teddy_) {
+    *anchor = min_key_size_;
+    return FindTeddy(begin, end);
+  } else {
+    return FindAhoCorasick(begin, end, anchor);
+  }
+}
+
+bool Prefilter::Verify(const unsigned char *begin, const unsigned char *end) const
+{
+  for (std::size_t i = 0; i < keys_.size(); i++) {
+    if ((std::size_t)(end - begin) >= keys_[i].length()
+        && memcmp(begin, keys_[i].data(), keys_[i].length()) == 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+const unsigned char *Prefilter::FindTeddy(const unsigned char *begin, const unsigned char *end) const
+{
+  const unsigned char *p = begin;
+#if defined(REGEN_ENABLE_XBYAK) && !defined(XBYAK32)
+  TeddyCode::Scan scan = teddy_scan();
+  while (end - p > 16) {
+    std::size_t blocks = (end - p - 17) / 16 + 1;
+    const unsigned char *hit = scan(p, blocks, &teddy_mask_[0][0]);
+    if (hit == NULL) {
+      p += blocks * 16;
+      break;
+    }
+    if (Verify(hit, end)) return hit;
+    p = hit + 1;
+  }
+#endif
+  for (; p < end; p++) {
+    if (Verify(p, end)) return p;
+  }
+  return end;
+}
+
+const unsigned char *Prefilter::FindAhoCorasick(const unsigned char *begin, const unsigned char *end,
+                                                std::size_t *anchor) const
+{
+  uint32_t state = 0;
+  for (const unsigned char *p = begin; p < end; p++) {
+    if (state == 0) {
+      /* skip bytes no keyword starts with. */
+      while (!ac_start_[*p]) {
+        if (++p == end) return end;
+      }
+    }
+    state = ac_transition_[state * ac_class_num_ + ac_class_[*p]];
+    if (ac_output_[state] != 0) {
+      *anchor = ac_output_[state];
+      return p + 1 - *anchor;
+    }
+  }
+  return end;
+}
+
+const unsigned char *Prefilter::FindKeyword(const unsigned char *begin, const unsigned char *end) const
+{
+  if ((std::size_t)(end - begin) < key_size_) return end;
+#ifdef REGEN_ENABLE_XBYAK
+  if (mie::isAvaiableSSE42() && end - begin >= 32) {
+    /* findStr may read 16 bytes beyond its end. */
+    const char *safe_end = (const char *)end - 16;
+    const char *found = mie::findStr((const char *)begin, safe_end, key_, key_size_);
+    if (found != safe_end) return (const unsigned char *)found;
+    begin = (const unsigned char *)safe_end - (key_size_ - 1);
+  }
+#endif
+  for (;;) {
+    const void *found = memchr(begin, key_[0], end - begin - (key_size_ - 1));
+    if (found == NULL) return end;
+    begin = (const unsigned char *)found;
+    if (memcmp(begin + 1, key_ + 1, key_size_ - 1) == 0) return begin;
+    begin++;
+  }
+}
+
+const unsigned char *Prefilter::Candidate(const unsigned char *begin, const unsigned char *end,
+                                          const unsigned char **cache) const
+{
+  if (cache[0] == NULL || cache[0] < begin) {
+    std::size_t anchor;
+    const unsigned char *found = Find(begin, end, &anchor);
+    if (found == end) return end;
+    const unsigned char *bound = begin;
+    if (max_length_ != std::numeric_limits<std::size_t>::max()
+        && (std::size_t)(found - begin) + anchor > max_length_) {
+      bound = found + anchor - max_length_;
+    }
+    const unsigned char *restart = found;
+    while (restart > bound && involve_[restart[-1]]) restart--;
+    /* the DFA restarts from the reset state, which is not at the beginning
+     * of a line: let it see the delimiter itself ("^ab"). */
+    if (restart > begin && restart[-1] == delimiter_) restart--;
+    cache[0] = found;
+    cache[1] = restart;
+  }
+  return std::max(begin, cache[1]);
+}
+
+} // namespace regen
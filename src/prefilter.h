@@ -0,0 +1,68 @@
+#ifndef REGEN_PREFILTER_H_
+#define  REGEN_PREFILTER_H_
+#include "regen.h"
+#include "util.h"
+#include "expr.h"
+
+namespace regen {
+
+/* Required keyword search for FilteredMatch, shared by every engine.
+ * every match contains the keyword, consists of involved bytes only, and
+ * is at most max_length long, so when a DFA has no match in progress it
+ * can skip ahead to where a match around the next keyword could start.
+ * the search uses SSE4.2 when it is available, memchr otherwise.
+ *
+ * patterns without a single keyword (e.g. "(GET|POST|PUT)x+") may still
+ * have a small set of candidate keywords one of which every match
+ * contains. up to TeddyMaxKeywords of them are searched with Teddy
+ * (SSSE3 shuffles over the first two bytes, then verification), larger
+ * sets or machines without SSSE3 use an Aho-Corasick automaton. */
+class Prefilter {
+public:
+  Prefilter(): key_size_(0), delimiter_('\n') {}
+  Prefilter(const ExprInfo &info, const Regen::Options &flag);
+  bool empty() const { return key_size_ == 0 && keys_.empty(); }
+  /* first occurrence of a keyword in [begin, end), or end. every other
+   * occurrence ends at or after the returned position + *anchor. */
+  const unsigned char *Find(const unsigned char *begin, const unsigned char *end,
+                            std::size_t *anchor) const;
+  /* where matching has to restart not to miss a match in [begin, end),
+   * or end if there is none. cache[2] (initially NULL) keeps the last
+   * keyword position and its restart point across calls on one input. */
+  const unsigned char *Candidate(const unsigned char *begin, const unsigned char *end,
+                                 const unsigned char **cache) const;
+  /* Candidate() for JIT-ed code. */
+  static const unsigned char *Candidate(const unsigned char *begin, const unsigned char *end,
+                                        const unsigned char **cache, const Prefilter *filter)
+  { return filter->Candidate(begin, end, cache); }
+  static const std::size_t MaxKeywordSize = 16;
+  static const std::size_t TeddyMaxKeywords = 8;
+private:
+  const unsigned char *FindKeyword(const unsigned char *begin, const unsigned char *end) const;
+  const unsigned char *FindTeddy(const unsigned char *begin, const unsigned char *end) const;
+  const unsigned char *FindAhoCorasick(const unsigned char *begin, const unsigned char *end,
+                                       std::size_t *anchor) const;
+  bool Verify(const unsigned char *begin, const unsigned char *end) const;
+  void BuildAhoCorasick();
+  char key_[32]; // zero padded, the SSE4.2 search loads 16 bytes of it
+  std::size_t key_size_;
+  std::size_t max_length_;
+  unsigned char delimiter_;
+  bool involve_[256];
+  /* candidate keywords, truncated to MaxKeywordSize. */
+  std::vector<std::string> keys_;
+  std::size_t min_key_size_;
+  bool teddy_;
+  /* nibble lookup tables of the first and second byte, bit i for keys_[i]:
+   * lo(c & 15) & hi(c >> 4) has bit i set iff c is the byte of keys_[i]. */
+  uint8_t teddy_mask_[4][16];
+  /* Aho-Corasick automaton with all failure transitions resolved. */
+  uint16_t ac_class_[256];
+  std::size_t ac_class_num_;
+  bool ac_start_[256];
+  std::vector<uint32_t> ac_transition_; // state * ac_class_num_ + class
+  std::vector<uint8_t> ac_output_;      // longest keyword ending here, or 0
+};
+
+} // namespace regen
+#endif // REGEN_PREFILTER_H_
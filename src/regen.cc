@@ -1,17 +1,31 @@
 #include "regen.h"
 #include "regex.h"
+#include "regexset.h"
+#include "regexcache.h"
 
 namespace regen {
 
 const Regen::Options Regen::DefaultOptions(Regen::Options::NoParseFlags);
 
+/* built under the lock, as threads may Consume() with one Regen. */
+struct Regen::ConsumeRegex {
+  ConsumeRegex(): regex(NULL) {}
+  ~ConsumeRegex() { delete regex; }
+  Regex *regex;
+#ifdef REGEN_ENABLE_PARALLEL
+  boost::mutex mutex;
+#endif
+};
+
 Regen::Options::Options(Regen::Options::ParseFlag flag, const unsigned char delimiter):
     shortest_match_(false), one_line_(false), reverse_regex_(false),
     reverse_match_(false), noprefix_match_(false), nosuffix_match_(false), parallel_match_(false),
     captured_match_(false), filtered_match_(false),
     complement_ext_(false), intersection_ext_(false), recursion_ext_(false), xor_ext_(false), shuffle_ext_(false),
     permutation_ext_(false), reverse_ext_(false), weakbackref_ext_(false),
-    encoding_utf8_(false), non_nullable_(false),
+    encoding_utf8_(false), non_nullable_(false), thread_num_(0),
+    parallel_threshold_(DefaultParallelThreshold),
+    state_limit_(DefaultStateLimit), state_budget_(DefaultStateBudget),
     delimiter_(delimiter)
 {
   shortest_match_ = flag & ShortestMatch;
@@ -36,8 +50,35 @@ Regen::Options::Options(Regen::Options::ParseFlag flag, const unsigned char deli
   non_nullable_ = flag & NonNullable;
 }
 
+Regen::Options::ParseFlag Regen::Options::parse_flag() const
+{
+  int flag = NoParseFlags;
+  if (shortest_match_) flag |= ShortestMatch;
+  if (ignore_case_) flag |= IgnoreCase;
+  if (one_line_) flag |= OneLine;
+  if (reverse_regex_) flag |= ReverseRegex;
+  if (reverse_match_) flag |= ReverseMatch;
+  if (noprefix_match_) flag |= NoPrefixMatch;
+  if (nosuffix_match_) flag |= NoSuffixMatch;
+  if (parallel_match_) flag |= ParallelMatch;
+  if (captured_match_) flag |= CapturedMatch;
+  if (filtered_match_) flag |= FilteredMatch;
+  if (complement_ext_) flag |= ComplementExt;
+  if (intersection_ext_) flag |= IntersectionExt;
+  if (recursion_ext_) flag |= RecursionExt;
+  if (xor_ext_) flag |= XORExt;
+  if (shuffle_ext_) flag |= ShuffleExt;
+  if (permutation_ext_) flag |= PermutationExt;
+  if (reverse_ext_) flag |= ReverseExt;
+  if (weakbackref_ext_) flag |= WeakBackRefExt;
+  if (encoding_utf8_) flag |= EncodingUTF8;
+  if (non_nullable_) flag |= NonNullable;
+  return static_cast<ParseFlag>(flag);
+}
+
 Regen::Regen(const std::string &regex, const Regen::Options options):
-    regex_(NULL), reverse_regex_(NULL), flag_(options)
+    regex_(NULL), reverse_regex_(NULL), consume_(new ConsumeRegex), flag_(options),
+    olevel_(Options::Onone)
 {
   regex_ = new Regex(regex, flag_);
   if (flag_.captured_match() && !flag_.prefix_match()
@@ -48,14 +89,21 @@ Regen::Regen(const std::string &regex, const Regen::Options options):
     opt.suffix_match(false);
     opt.longest_match(true);
     opt.captured_match(false);
+    opt.parallel_match(false);
     reverse_regex_ = new Regex(regex, opt);
   }
 }
 
+Regen::Regen(Regex *regex):
+    regex_(regex), reverse_regex_(NULL), consume_(new ConsumeRegex), flag_(regex->flag()),
+    olevel_(regex->olevel())
+{}
+
 Regen::~Regen()
 {
   delete regex_;
   delete reverse_regex_;
+  delete consume_;
 }
 
 bool Regen::Compile(Options::CompileFlag olevel)
@@ -64,9 +112,29 @@ bool Regen::Compile(Options::CompileFlag olevel)
   if (reverse_regex_ != NULL) {
     compile &= reverse_regex_->Compile(olevel);
   }
+  {
+#ifdef REGEN_ENABLE_PARALLEL
+    boost::mutex::scoped_lock lock(consume_->mutex);
+#endif
+    if (consume_->regex != NULL) compile &= consume_->regex->Compile(olevel);
+  }
+  olevel_ = olevel;
   return compile;
 }
 
+bool Regen::Save(std::string *image) const
+{
+  if (reverse_regex_ != NULL) return false;
+  if (!regex_->dfa().Complete() && !regex_->Compile(Options::O0)) return false;
+  return regex_->Save(image);
+}
+
+Regen *Regen::Load(const StringPiece& image, Options::CompileFlag olevel)
+{
+  Regex *regex = Regex::Load(image, olevel);
+  return regex == NULL ? NULL : new Regen(regex);
+}
+
 bool Regen::Match(const StringPiece &string, StringPiece *result) const
 {
   if (result != NULL && flag_.captured_match()) {
@@ -97,9 +165,8 @@ bool Regen::FullMatch(const StringPiece& string, const StringPiece& pattern, Str
 bool Regen::FullMatch(const StringPiece& string, const StringPiece &pattern, Options opt, StringPiece *result)
 {
   opt.full_match(true);
-  Regex re(pattern, opt);
-  re.Compile();
-  return re.Match(string, result);
+  RegexCache::Ref re(pattern, opt);
+  return re->Match(string, result);
 }
 
 bool Regen::PartialMatch(const StringPiece& string, const StringPiece &pattern, StringPiece *result)
@@ -110,19 +177,161 @@ bool Regen::PartialMatch(const StringPiece& string, const StringPiece &pattern,
 bool Regen::PartialMatch(const StringPiece& string, const StringPiece& pattern, Options opt, StringPiece *result)
 {
   opt.partial_match(true);
-  Regex re(pattern, opt);
-  re.Compile();
-  return re.Match(string, result);
+  RegexCache::Ref re(pattern, opt);
+  return re->Match(string, result);
+}
+
+/* Consume() matches prefixes, forward and without captures. */
+static Regen::Options ConsumeOptions(const Regen::Options &flag)
+{
+  Regen::Options opt(flag);
+  opt.reverse(false);
+  opt.prefix_match(true);
+  opt.suffix_match(false);
+  opt.captured_match(false);
+  opt.parallel_match(false);
+  return opt;
+}
+
+static bool Consume(const Regex &re, Regen::StringPiece *string, Regen::StringPiece *result)
+{
+  Regen::StringPiece result_;
+  if (!re.Match(*string, &result_)) return false;
+  if (result != NULL) result->set(string->begin(), result_.end());
+  string->set_begin(result_.end());
+  return true;
+}
+
+bool Regen::Consume(StringPiece* string, StringPiece* result) const
+{
+  const Regex *re = regex_;
+  if (!flag_.prefix_match() || flag_.suffix_match() || flag_.reverse_match()) {
+#ifdef REGEN_ENABLE_PARALLEL
+    boost::mutex::scoped_lock lock(consume_->mutex);
+#endif
+    if (consume_->regex == NULL) {
+      consume_->regex = new Regex(regex_->regex(), ConsumeOptions(flag_));
+      if (olevel_ != Options::Onone) consume_->regex->Compile(olevel_);
+    }
+    re = consume_->regex;
+  }
+  return regen::Consume(*re, string, result);
+}
+
+bool Regen::Consume(StringPiece* string, const StringPiece& pattern, StringPiece* result)
+{
+  return Consume(string, pattern, DefaultOptions, result);
+}
+
+bool Regen::Consume(StringPiece* string, const StringPiece& pattern, Options opt, StringPiece* result)
+{
+  RegexCache::Ref re(pattern, ConsumeOptions(opt));
+  return regen::Consume(*re, string, result);
+}
+
+Regen::CacheStats Regen::cache_stats()
+{
+  return RegexCache::Instance().stats();
+}
+
+void Regen::cache_budget(std::size_t bytes)
+{
+  RegexCache::Instance().budget(bytes);
+}
+
+Regen::Tier Regen::tier() const
+{
+  if (regex_->bitnfa() != NULL) return BitParallelNFA;
+  return regex_->dfa().Complete() ? FullDFA : LazyDFA;
+}
+
+Regen::StateStats Regen::state_stats() const
+{
+  const DFA &dfa = regex_->dfa();
+  StateStats stats;
+  stats.states = dfa.size();
+  stats.built = dfa.built_num();
+  stats.flushes = dfa.flush_num();
+  return stats;
+}
+
+Regen::Stream::Stream(const Regen &re): re_(re)
+{
+  state_ = re_.regex_->dfa().start_state();
+  re_.regex_->dfa().Pin(&state_);
+  Reset();
+}
+
+Regen::Stream::~Stream()
+{
+  re_.regex_->dfa().Unpin(&state_);
+}
+
+void Regen::Stream::Reset()
+{
+  const DFA &dfa = re_.regex_->dfa();
+  dfa.Unpin(&state_);
+  state_ = dfa.start_state();
+  dfa.Pin(&state_);
+  offset_ = 0;
+  match_end_ = npos;
+  /* chunks come in forward, a reverse match would need them all. */
+  done_ = re_.flag_.reverse_match();
+}
+
+bool Regen::Stream::Feed(const StringPiece& chunk)
+{
+  if (done_) return false;
+  const DFA &dfa = re_.regex_->dfa();
+  const unsigned char *matchptr = NULL;
+  const bool track = !re_.flag_.suffix_match();
+  const DFA::state_t state = dfa.Run(chunk, &state_, track ? &matchptr : NULL);
+  if (matchptr != NULL) match_end_ = offset_ + (matchptr - chunk.ubegin());
+  offset_ += chunk.size();
+  done_ = state == DFA::REJECT
+      || (matched() && re_.flag_.shortest_match());
+  return !done_;
+}
+
+bool Regen::Stream::End()
+{
+  if (done_) return matched();
+  done_ = true;
+  const DFA &dfa = re_.regex_->dfa();
+  if (dfa.RunEnd(&state_, offset_ == 0)
+      && (re_.flag_.suffix_match() || !matched())) {
+    match_end_ = offset_;
+  }
+  return matched();
+}
+
+RegenSet::RegenSet(Regen::Options options):
+    set_(new RegexSet(options))
+{}
+
+RegenSet::~RegenSet()
+{
+  delete set_;
+}
+
+std::size_t RegenSet::Add(const std::string &regex)
+{
+  return set_->Add(regex);
+}
+
+std::size_t RegenSet::size() const
+{
+  return set_->size();
 }
 
-bool Regen::Consume(const StringPiece& string, const StringPiece& pattern, StringPiece* result)
+bool RegenSet::Compile(Regen::Options::CompileFlag olevel)
 {
-  return false;
+  return set_->Compile(olevel);
 }
 
-bool Regen::Consume(const StringPiece& string, const StringPiece& pattern, Options opt, StringPiece* result)
+bool RegenSet::Match(const Regen::StringPiece& string, std::vector<std::size_t> *ids) const
 {
-  return false;
+  return set_->Match(string, ids);
 }
 
 } // namespace regen
@@ -2,11 +2,13 @@
 #define REGEN_H_
 
 #include <string>
+#include <vector>
 #include <string.h>
 
 namespace regen {
 
 class Regex;
+class RegexSet;
 
 class Regen {
 public:
@@ -46,6 +48,8 @@ public:
       Onone = -1, O0 = 0, O1 = 1, O2 = 2, O3 = 3
     };
     Options(ParseFlag flag = NoParseFlags, const unsigned char delimiter = '\n');
+    /* the flags this was built from, with the changes since. */
+    ParseFlag parse_flag() const;
     bool shortest_match() const { return shortest_match_; }
     void shortest_match(bool b) { shortest_match_ = b; }
     bool longest_match() const { return !shortest_match(); }
@@ -68,6 +72,9 @@ public:
     void full_match(bool b) { prefix_match(b); suffix_match(b); }
     bool partial_match() const { return !full_match(); }
     void partial_match(bool b) { full_match(!b); }
+    /* ParallelMatch: the input is split between threads, matched by the
+     * SFA of the DFA. it needs the whole DFA (Regen::FullDFA): in the
+     * other tiers the input is matched by one thread. */
     bool parallel_match() const { return parallel_match_; }
     void parallel_match(bool b) { parallel_match_ = b; }
     bool captured_match() const { return captured_match_; }
@@ -98,6 +105,25 @@ public:
     void encoding_ascii(bool b) { encoding_utf8(!b); }
     bool non_nullable() const { return non_nullable_; }
     void non_nullable(bool b) { non_nullable_ = b; }
+    /* number of threads used by ParallelMatch (0: number of cores) */
+    std::size_t thread_num() const { return thread_num_; }
+    void thread_num(std::size_t n) { thread_num_ = n; }
+    /* inputs shorter than this are matched sequentially by ParallelMatch
+     * (splitting them costs more than it saves). */
+    std::size_t parallel_threshold() const { return parallel_threshold_; }
+    void parallel_threshold(std::size_t n) { parallel_threshold_ = n; }
+    static const std::size_t DefaultParallelThreshold = 1 << 20;
+    /* most states of the DFA built by Compile(). a pattern with more
+     * falls back to a DFA built while matching (see Regen::tier()). */
+    std::size_t state_limit() const { return state_limit_; }
+    void state_limit(std::size_t n) { state_limit_ = n; }
+    static const std::size_t DefaultStateLimit = 1000;
+    /* most states kept by a DFA built while matching (0: unlimited).
+     * over the budget they are flushed, and built again from the
+     * current state on. */
+    std::size_t state_budget() const { return state_budget_; }
+    void state_budget(std::size_t n) { state_budget_ = n; }
+    static const std::size_t DefaultStateBudget = 1 << 14;
     const unsigned char delimiter() const { return delimiter_; }
  private:
     bool shortest_match_;
@@ -120,6 +146,10 @@ public:
     bool weakbackref_ext_;
     bool encoding_utf8_;
     bool non_nullable_;
+    std::size_t thread_num_;
+    std::size_t parallel_threshold_;
+    std::size_t state_limit_;
+    std::size_t state_budget_;
     const unsigned char delimiter_;
   };
   static const Options DefaultOptions;
@@ -186,15 +216,117 @@ public:
   static bool PartialMatch(const StringPiece &string, const StringPiece& pattern, Options opt, StringPiece *result = NULL);
   static bool PartialMatch(const StringPiece &string, const StringPiece& pattern, StringPiece *result = NULL);
 
-  bool Consume(const StringPiece& string, StringPiece* result = NULL) const;
-  static bool Consume(const StringPiece& string, const Regen& re, StringPiece* result = NULL) { return re.Consume(string, result); }
-  static bool Consume(const StringPiece& string, const StringPiece& pattern, StringPiece* result = NULL);
-  static bool Consume(const StringPiece& string, const StringPiece& pattern, Options opt, StringPiece* result = NULL);
+  /* image of the compiled pattern, and the Regen loaded back from it
+   * (e.g. mapped with Util::mmap_t) without parsing or building the DFA.
+   * Save() fails if the DFA could not be built, or for CapturedMatch
+   * patterns which need a second, reverse regex. Load() returns NULL for
+   * an invalid image. it copies the transition table out of the image
+   * (1KB per state, checked as it goes), so it costs time and memory in
+   * the number of states, and the image need not outlive the Regen. */
+  bool Save(std::string *image) const;
+  static Regen *Load(const StringPiece& image, Options::CompileFlag olevel = Options::O3);
+
+  /* the static helpers keep compiled patterns in a process wide LRU cache
+   * of at most cache_budget bytes. */
+  struct CacheStats {
+    std::size_t hits;
+    std::size_t misses;
+    std::size_t entries;
+    std::size_t memory;
+    std::size_t budget;
+  };
+  static CacheStats cache_stats();
+  static void cache_budget(std::size_t bytes);
+
+  /* how the pattern is matched: with the whole DFA built by Compile(),
+   * or (before Compile(), or over Options::state_limit) with a DFA built
+   * while matching, starting from the states Compile() got to build.
+   * over the limit, patterns of at most 64 positions (no anchors or
+   * operators) are matched by a bit-parallel NFA instead, as are those
+   * with large bounded repetitions, whose X{n,m} it counts. Compile()
+   * returns false when it leaves the pattern to the lazy DFA. */
+  enum Tier {
+    FullDFA, LazyDFA, BitParallelNFA
+  };
+  Tier tier() const;
+
+  /* states of the DFA (see Options::state_budget): how many it holds,
+   * how many were built while matching, and how many times they were
+   * flushed. */
+  struct StateStats {
+    std::size_t states;
+    std::size_t built;
+    std::size_t flushes;
+  };
+  StateStats state_stats() const;
+
+  /* matches a prefix of `*string' (the longest one, or the shortest with
+   * ShortestMatch), sets `result' to it and advances `*string' past it. */
+  bool Consume(StringPiece* string, StringPiece* result = NULL) const;
+  static bool Consume(StringPiece* string, const Regen& re, StringPiece* result = NULL) { return re.Consume(string, result); }
+  static bool Consume(StringPiece* string, const StringPiece& pattern, StringPiece* result = NULL);
+  static bool Consume(StringPiece* string, const StringPiece& pattern, Options opt, StringPiece* result = NULL);
+
+  /* matching over an input given in chunks (pipes, sockets, inflated
+   * data...). the DFA state is carried from one chunk to the next, so a
+   * match may span any number of chunks. forward matching only: with a
+   * ReverseMatch Regen, the stream is over at once and never matches.
+   * the keyword prefilter of FilteredMatch is not used. */
+  class Stream {
+   public:
+    Stream(const Regen &re);
+    ~Stream();
+    void Reset();
+    /* matches the next chunk. returns false once the result is known and
+     * the rest of the input can be dropped. */
+    bool Feed(const StringPiece& chunk);
+    /* the input is over. returns whether it matched. */
+    bool End();
+    bool matched() const { return match_end_ != npos; }
+    /* end of the (last known) match, as an offset in the whole input. */
+    std::size_t match_end() const { return match_end_; }
+    std::size_t offset() const { return offset_; }
+    static const std::size_t npos = (std::size_t)-1;
+   private:
+    const Regen &re_;
+    /* pinned to the DFA, which renumbers it when its states are flushed. */
+    unsigned int state_;
+    std::size_t offset_;
+    std::size_t match_end_;
+    bool done_;
+    Stream(const Stream &);
+    void operator=(const Stream &);
+  };
 
 private:
+  Regen(Regex *regex);
   Regex *regex_;
   Regex *reverse_regex_;
+  /* prefix matching regex for Consume(), built on first use. */
+  struct ConsumeRegex;
+  ConsumeRegex *consume_;
   Options flag_;
+  Options::CompileFlag olevel_;
+  Regen(const Regen &);
+  void operator=(const Regen &);
+};
+
+/* many patterns matched against the same input in a single pass. */
+class RegenSet {
+public:
+  RegenSet(Regen::Options = Regen::Options::NoParseFlags);
+  ~RegenSet();
+  /* returns the id of the pattern: the number of patterns added before. */
+  std::size_t Add(const std::string &);
+  std::size_t size() const;
+  bool Compile(Regen::Options::CompileFlag olevel = Regen::Options::O3);
+  /* ids of all the patterns matching `string', in increasing order. */
+  bool Match(const Regen::StringPiece& string, std::vector<std::size_t> *ids) const;
+
+private:
+  RegexSet *set_;
+  RegenSet(const RegenSet &);
+  void operator=(const RegenSet &);
 };
 
 inline Regen::Options::ParseFlag operator|(Regen::Options::ParseFlag a, Regen::Options::ParseFlag b)
@@ -209,5 +341,6 @@ inline Regen::Options::ParseFlag& operator&=(Regen::Options::ParseFlag &a, Regen
 } // namespace regen
 
 using regen::Regen;
+using regen::RegenSet;
 
 #endif // REGEN_H_
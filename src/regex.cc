@@ -9,12 +9,61 @@ Regex::Regex(const Regen::StringPiece& pattern, const Regen::Options flags):
     involved_char_(std::bitset<256>()),
     olevel_(Regen::Options::Onone),
     dfa_failure_(false),
-    dfa_(flags)
+    dfa_(flags),
+    bitnfa_(NULL)
+#ifdef REGEN_ENABLE_PARALLEL
+    , sfa_(NULL)
+#endif
 {
   Parse();
   dfa_.set_expr_info(expr_info_);
 }
 
+Regex::Regex(const Regen::StringPiece& pattern, const Regen::Options flags, const Regen::StringPiece& image):
+    regex_(pattern.as_string()),
+    flag_(flags),
+    recursion_depth_(0),
+    must_max_length_(0),
+    involved_char_(std::bitset<256>()),
+    count_involved_char_(0),
+    olevel_(Regen::Options::Onone),
+    dfa_failure_(false),
+    dfa_(flags),
+    bitnfa_(NULL)
+#ifdef REGEN_ENABLE_PARALLEL
+    , sfa_(NULL)
+#endif
+{
+  dfa_failure_ = !dfa_.Deserialize(image);
+  expr_info_.min_length = dfa_.expr_info().min_length;
+  expr_info_.max_length = dfa_.expr_info().max_length;
+  expr_info_.involve = dfa_.expr_info().involve;
+}
+
+Regex *Regex::Load(const Regen::StringPiece& image, Regen::Options::CompileFlag olevel)
+{
+  DFA::ImageHeader header;
+  Regen::StringPiece pattern;
+  if (!DFA::ReadImageHeader(image, &header, &pattern)) return NULL;
+  Regen::Options flags(static_cast<Regen::Options::ParseFlag>(header.parse_flag), header.delimiter);
+  flags.thread_num(header.thread_num);
+  Regex *regex = new Regex(pattern, flags, image);
+  if (regex->dfa_failure_) {
+    delete regex;
+    return NULL;
+  }
+  regex->Compile(olevel);
+  return regex;
+}
+
+Regex::~Regex()
+{
+  delete bitnfa_;
+#ifdef REGEN_ENABLE_PARALLEL
+  delete sfa_;
+#endif
+}
+
 StateExpr* Regex::CombineStateExpr(StateExpr *e1, StateExpr *e2, ExprPool *p)
 {
   StateExpr *s;
@@ -128,6 +177,24 @@ void Regex::Parse()
   expr_info_.min_length = expr_info_.orig_root->min_length();
   expr_info_.max_length = expr_info_.orig_root->max_length();
   e->FillTransition();
+
+  /* number the positions, for NFAMatch. */
+  std::set<StateExpr*> &first = e->transition().first;
+  std::set<StateExpr*> numbered(first.begin(), first.end());
+  state_exprs_.assign(first.begin(), first.end());
+  for (std::size_t i = 0; i < state_exprs_.size(); i++) {
+    StateExpr *s = state_exprs_[i];
+    s->set_state_id(i);
+    for (std::set<StateExpr*>::iterator iter = s->follow().begin(); iter != s->follow().end(); ++iter) {
+      if (numbered.insert(*iter).second) state_exprs_.push_back(*iter);
+    }
+  }
+
+  /* the delimiter always stands alone, as anchors and dots treat it
+   * specially. */
+  expr_info_.byte_class.Clear();
+  expr_info_.byte_class.Refine(flag_.delimiter());
+  ByteClassVisitor::Fill(e, &expr_info_.byte_class);
 }
 
 /* Regen parsing rules
@@ -210,6 +277,41 @@ Expr* Regex::e4(Lexer *lexer, ExprPool *pool)
   return e;
 }
 
+/* the position X of a repetition X{n,m} or (X?){n,m} the bit-parallel
+ * NFA can count (see Counter), or NULL. */
+static StateExpr* CountedPosition(Expr *e, bool *optional)
+{
+  *optional = false;
+  if (e->type() == Expr::kQmark) {
+    Qmark *q = static_cast<Qmark*>(e);
+    if (q->non_greedy() || q->probability() != 0.0) return NULL;
+    e = q->lhs();
+    *optional = true;
+  }
+  switch (e->type()) {
+    case Expr::kLiteral: case Expr::kCharClass: case Expr::kDot:
+      return static_cast<StateExpr*>(e);
+    default:
+      return NULL;
+  }
+}
+
+static void CollectPositions(Expr *e, std::vector<StateExpr*> *positions)
+{
+  switch (Expr::SuperTypeOf(e)) {
+    case Expr::kStateExpr:
+      positions->push_back(static_cast<StateExpr*>(e));
+      break;
+    case Expr::kUnaryExpr:
+      CollectPositions(static_cast<UnaryExpr*>(e)->lhs(), positions);
+      break;
+    case Expr::kBinaryExpr:
+      CollectPositions(static_cast<BinaryExpr*>(e)->lhs(), positions);
+      CollectPositions(static_cast<BinaryExpr*>(e)->rhs(), positions);
+      break;
+  }
+}
+
 Expr* Regex::e5(Lexer *lexer, ExprPool *pool)
 {
   Expr *e;
@@ -245,6 +347,9 @@ Expr* Regex::e5(Lexer *lexer, ExprPool *pool)
       case Lexer::kRepetition: {
         std::pair<int, int> r = lexer->repetition();
         int lower_repetition = r.first, upper_repetition = r.second;
+        bool optional;
+        const bool counted = upper_repetition >= 2 && !non_greedy && probability == 0.0
+            && !flag_.reverse_regex() && CountedPosition(e, &optional) != NULL;
         if (lower_repetition == 0 && upper_repetition == 0) {
           //delete e;
           e = pool->alloc<Epsilon>();
@@ -277,6 +382,13 @@ Expr* Regex::e5(Lexer *lexer, ExprPool *pool)
             e = pool->alloc<Concat>(e, pool->alloc<Qmark>(f->Clone(pool), non_greedy, probability), flag_.reverse_regex());
           }
         }
+        if (counted) {
+          Counter counter;
+          counter.lower = optional ? 0 : r.first;
+          counter.upper = upper_repetition;
+          CollectPositions(e, &counter.positions);
+          expr_info_.counters.push_back(counter);
+        }
         break;
       }
       default:
@@ -674,31 +786,77 @@ void Regex::CreateRegexFromDFA(const DFA &dfa, ExprInfo *info, ExprPool *p)
 bool Regex::Compile(Regen::Options::CompileFlag olevel) {
   if (olevel == Regen::Options::Onone || olevel_ >= olevel) return true;
   if (!dfa_failure_ && !dfa_.Complete()) {
-    /* try create DFA.  */
-    std::size_t limit = state_exprs_.size();
-    limit = 1000; // default limitation is 1000 (it's may finish within a second).
+    /* the DFA of large bounded repetitions mostly counts, in as many
+     * states: the bit-parallel NFA counts them without building it. */
+    std::size_t counted = 0;
+    for (std::size_t i = 0; i < expr_info_.counters.size(); i++) {
+      counted += expr_info_.counters[i].upper;
+    }
+    if (counted > BitNFA::MaxPositions) dfa_failure_ = BuildBitNFA();
+  }
+  if (!dfa_failure_ && !dfa_.Complete()) {
+    /* try create DFA, of at most state_limit states (the default 1000
+     * may finish within a second). */
+    std::size_t limit = flag_.state_limit();
+    if (flag_.state_budget() != 0) limit = std::min(limit, flag_.state_budget());
     dfa_failure_ = !dfa_.Construct(limit);
+    if (!dfa_failure_) dfa_.Minimize();
   }
   if (dfa_failure_) {
-    /* can not create DFA. (too many states) */
-    return false;
+    /* too many states: small patterns are matched by the bit-parallel
+     * NFA, whose size does not depend on the number of DFA states. the
+     * rest fall back to the lazy DFA, which goes on from the states built
+     * so far, with the states JIT-ed as they are found. */
+    dfa_.Compile(olevel);
+    if (!BuildBitNFA()) return false;
+    olevel_ = olevel;
+    return true;
+  }
+
+#ifdef REGEN_ENABLE_PARALLEL
+  if (flag_.parallel_match() && sfa_ == NULL) {
+    /* SFA may be much larger than DFA. when it does not fit in the
+     * limit, its states are built on demand while matching. */
+    sfa_ = new SFA(dfa_, flag_.thread_num(), flag_.state_limit());
+    sfa_->parallel_threshold(flag_.parallel_threshold());
   }
+#endif
 
   if (!dfa_.Compile(olevel)) {
     olevel_ = dfa_.olevel();
   } else {
     olevel_ = olevel;
   }
+#ifdef REGEN_ENABLE_PARALLEL
+  if (sfa_ != NULL && olevel_ >= Regen::Options::O1) sfa_->Compile(olevel_);
+#endif
   return olevel_ == olevel;
 }
 
+bool Regex::BuildBitNFA()
+{
+  if (bitnfa_ == NULL && expr_info_.expr_root != NULL) {
+    bitnfa_ = new BitNFA(expr_info_, flag_);
+    if (!bitnfa_->ok()) {
+      delete bitnfa_;
+      bitnfa_ = NULL;
+    }
+  }
+  return bitnfa_ != NULL;
+}
+
 bool Regex::Match(const Regen::StringPiece& string, Regen::StringPiece *result)  const {
+  if (bitnfa_ != NULL) return bitnfa_->Match(string, result);
+#ifdef REGEN_ENABLE_PARALLEL
+  if (sfa_ != NULL) return sfa_->Match(string, result);
+#endif
   return dfa_.Match(string, result);
 }
 
 /* Thompson-NFA based matching */
 bool Regex::NFAMatch(const Regen::StringPiece& string, Regen::StringPiece *result) const
 {
+  if (bitnfa_ != NULL) return bitnfa_->Match(string, result);
   typedef std::vector<StateExpr*> NFA;
   std::size_t nfa_size = state_exprs_.size();
   std::vector<uint32_t> next_states_flag(nfa_size);
@@ -9,16 +9,21 @@
 #include "generator.h"
 #include "nfa.h"
 #include "dfa.h"
+#include "bitnfa.h"
 #ifdef REGEN_ENABLE_PARALLEL
 #include "sfa.h"
 #endif
 
 namespace regen {
 
+#ifdef REGEN_ENABLE_PARALLEL
+class SFA;
+#endif
+
 class Regex {
 public:
   Regex(const Regen::StringPiece& regex, const Regen::Options = Regen::Options::NoParseFlags);
-  ~Regex() {}
+  ~Regex();
   void PrintRegex() const;
   static void PrintRegex(const DFA &);
   void PrintParseTree() const;
@@ -30,11 +35,18 @@ public:
   bool Match(const Regen::StringPiece& string, Regen::StringPiece *result = NULL) const;
   bool NFAMatch(const Regen::StringPiece& string, Regen::StringPiece *result = NULL) const;
   const std::string& regex() const { return regex_; }
+  const Regen::Options& flag() const { return flag_; }
+  /* image of the complete DFA (see DFA::Serialize), and the regex built
+   * back from it without parsing, or NULL if the image is invalid. */
+  bool Save(std::string *image) const { return dfa_.Serialize(regex_, image); }
+  static Regex *Load(const Regen::StringPiece& image, Regen::Options::CompileFlag olevel = Regen::Options::O3);
   std::size_t max_length() const { return expr_info_.max_length; }
   std::size_t min_length() const { return expr_info_.min_length; }
   std::size_t must_max_length() const { return must_max_length_; }
   const std::string& must_max_word() const { return must_max_word_; }
   const DFA& dfa() const { return dfa_; }
+  /* the bit-parallel NFA Compile() falls back to, or NULL. */
+  const BitNFA* bitnfa() const { return bitnfa_; }
   Regen::Options::CompileFlag olevel() const { return olevel_; }
   Expr* expr_root() const { return expr_info_.expr_root; }
   const ExprInfo& expr_info() const { return expr_info_; }
@@ -42,7 +54,10 @@ public:
   static CharClass* BuildCharClass(Lexer *, CharClass *);
 
 private:
+  Regex(const Regen::StringPiece& regex, const Regen::Options flags, const Regen::StringPiece& image);
   void Parse();
+  /* the bit-parallel NFA of the pattern, if it fits one. */
+  bool BuildBitNFA();
   Expr* e0(Lexer *, ExprPool *);
   Expr* e1(Lexer *, ExprPool *);
   Expr* e2(Lexer *, ExprPool *);
@@ -68,6 +83,10 @@ private:
   Regen::Options::CompileFlag olevel_;
   bool dfa_failure_;
   DFA dfa_;
+  BitNFA *bitnfa_;
+#ifdef REGEN_ENABLE_PARALLEL
+  SFA *sfa_;
+#endif
 };
 
 } // namespace regen
@@ -0,0 +1,133 @@
+#include "regexcache.h"
+
+namespace regen {
+
+/* everything which changes the compiled pattern. */
+static std::string Key(const Regen::StringPiece &regex, const Regen::Options &flag,
+                       Regen::Options::CompileFlag olevel)
+{
+  char key[160];
+  snprintf(key, sizeof(key), "%x:%d:%d:%lu:%lu:%lu:%lu:", (unsigned)flag.parse_flag(), (int)olevel,
+           (int)flag.delimiter(), (unsigned long)flag.thread_num(),
+           (unsigned long)flag.parallel_threshold(),
+           (unsigned long)flag.state_limit(), (unsigned long)flag.state_budget());
+  return std::string(key) + regex.as_string();
+}
+
+RegexCache &RegexCache::Instance()
+{
+  static RegexCache cache;
+  return cache;
+}
+
+RegexCache::~RegexCache()
+{
+  for (LRU::iterator iter = lru_.begin(); iter != lru_.end(); ++iter) {
+    delete (*iter)->regex;
+    delete *iter;
+  }
+}
+
+std::size_t RegexCache::MemorySize(const Regex &regex)
+{
+  return sizeof(Regex) + regex.regex().size()
+      + regex.state_exprs().size() * sizeof(StateExpr)
+      + regex.dfa().memory_size();
+}
+
+void RegexCache::budget(std::size_t budget)
+{
+#ifdef REGEN_ENABLE_PARALLEL
+  boost::mutex::scoped_lock lock(mutex_);
+#endif
+  budget_ = budget;
+  Evict();
+}
+
+Regen::CacheStats RegexCache::stats() const
+{
+#ifdef REGEN_ENABLE_PARALLEL
+  boost::mutex::scoped_lock lock(mutex_);
+#endif
+  Regen::CacheStats stats;
+  stats.hits = hits_;
+  stats.misses = misses_;
+  stats.entries = lru_.size();
+  stats.memory = memory_;
+  stats.budget = budget_;
+  return stats;
+}
+
+RegexCache::Entry *RegexCache::Acquire(const Regen::StringPiece &regex, const Regen::Options &flag,
+                                       Regen::Options::CompileFlag olevel)
+{
+  const std::string key = Key(regex, flag, olevel);
+  {
+#ifdef REGEN_ENABLE_PARALLEL
+    boost::mutex::scoped_lock lock(mutex_);
+#endif
+    std::map<std::string, LRU::iterator>::iterator iter = entries_.find(key);
+    if (iter != entries_.end()) {
+      hits_++;
+      lru_.splice(lru_.begin(), lru_, iter->second);
+      lru_.front()->refs++;
+      return lru_.front();
+    }
+    misses_++;
+  }
+
+  /* compiled without holding the lock, another thread may add it too. */
+  Regex *re = new Regex(regex, flag);
+  re->Compile(olevel);
+
+#ifdef REGEN_ENABLE_PARALLEL
+  boost::mutex::scoped_lock lock(mutex_);
+#endif
+  std::map<std::string, LRU::iterator>::iterator iter = entries_.find(key);
+  if (iter != entries_.end()) {
+    delete re;
+    lru_.splice(lru_.begin(), lru_, iter->second);
+    lru_.front()->refs++;
+    return lru_.front();
+  }
+  Entry *entry = new Entry;
+  entry->key = key;
+  entry->regex = re;
+  entry->size = MemorySize(*re);
+  entry->refs = 1;
+  entry->cached = true;
+  lru_.push_front(entry);
+  entries_[key] = lru_.begin();
+  memory_ += entry->size;
+  Evict();
+  return entry;
+}
+
+void RegexCache::Release(Entry *entry)
+{
+#ifdef REGEN_ENABLE_PARALLEL
+  boost::mutex::scoped_lock lock(mutex_);
+#endif
+  if (--entry->refs == 0 && !entry->cached) {
+    delete entry->regex;
+    delete entry;
+  }
+}
+
+/* drops least recently used entries until the rest fits in the budget. */
+void RegexCache::Evict()
+{
+  while (memory_ > budget_ && !lru_.empty()) {
+    Entry *entry = lru_.back();
+    lru_.pop_back();
+    entries_.erase(entry->key);
+    memory_ -= entry->size;
+    entry->cached = false;
+    if (entry->refs == 0) {
+      delete entry->regex;
+      delete entry;
+    }
+  }
+}
+
+} // namespace regen
@@ -0,0 +1,72 @@
+#ifndef REGEN_REGEXCACHE_H_
+#define REGEN_REGEXCACHE_H_
+
+#include "regex.h"
+#include <list>
+#ifdef REGEN_ENABLE_PARALLEL
+#include <boost/thread.hpp>
+#endif
+
+namespace regen {
+
+/* compiled patterns of the static Regen helpers (FullMatch, PartialMatch,
+ * Consume), shared by the whole process. entries are keyed by pattern,
+ * options and compile level, and the least recently used ones are dropped
+ * once their (approximate) memory exceeds the budget. a pattern borrowed
+ * through a Ref stays alive until the Ref goes away, even when it has been
+ * dropped meanwhile. without REGEN_ENABLE_PARALLEL there is no locking. */
+class RegexCache {
+public:
+  class Ref;
+  static RegexCache &Instance();
+  ~RegexCache();
+  std::size_t budget() const { return budget_; }
+  void budget(std::size_t budget);
+  Regen::CacheStats stats() const;
+  static const std::size_t DefaultBudget = 16 << 20;
+  static std::size_t MemorySize(const Regex &regex);
+
+private:
+  struct Entry {
+    std::string key;
+    Regex *regex;
+    std::size_t size;
+    std::size_t refs;
+    bool cached;
+  };
+  typedef std::list<Entry *> LRU; // most recently used first
+  friend class Ref;
+  RegexCache(): budget_(DefaultBudget), memory_(0), hits_(0), misses_(0) {}
+  Entry *Acquire(const Regen::StringPiece &regex, const Regen::Options &flag,
+                 Regen::Options::CompileFlag olevel);
+  void Release(Entry *entry);
+  void Evict();
+  LRU lru_;
+  std::map<std::string, LRU::iterator> entries_;
+  std::size_t budget_;
+  std::size_t memory_;
+  std::size_t hits_;
+  std::size_t misses_;
+#ifdef REGEN_ENABLE_PARALLEL
+  mutable boost::mutex mutex_;
+#endif
+  DISALLOW_COPY_AND_ASSIGN(RegexCache);
+};
+
+/* a compiled pattern borrowed from the cache. */
+class RegexCache::Ref {
+public:
+  Ref(const Regen::StringPiece &regex, const Regen::Options &flag,
+      Regen::Options::CompileFlag olevel = Regen::Options::O3):
+      entry_(Instance().Acquire(regex, flag, olevel)) {}
+  ~Ref() { Instance().Release(entry_); }
+  const Regex &operator*() const { return *entry_->regex; }
+  const Regex *operator->() const { return entry_->regex; }
+private:
+  Entry *entry_;
+  DISALLOW_COPY_AND_ASSIGN(Ref);
+};
+
+} // namespace regen
+
+#endif // REGEN_REGEXCACHE_H_
@@ -0,0 +1,103 @@
+#include "regexset.h"
+
+namespace regen {
+
+RegexSet::RegexSet(const Regen::Options flags):
+    flag_(flags),
+    olevel_(Regen::Options::Onone),
+    dfa_failure_(false),
+    dfa_(NULL)
+{
+  /* every pattern is matched forward and to its longest, all at once. */
+  if (flag_.filtered_match()) {
+    flag_.filtered_match(false);
+    flag_.prefix_match(false);
+  }
+  flag_.reverse(false);
+  flag_.longest_match(true);
+  flag_.parallel_match(false);
+  flag_.captured_match(false);
+}
+
+RegexSet::~RegexSet()
+{
+  for (std::size_t i = 0; i < regexes_.size(); i++) {
+    delete regexes_[i];
+  }
+  delete dfa_;
+}
+
+std::size_t RegexSet::Add(const Regen::StringPiece& regex)
+{
+  std::size_t id = regexes_.size();
+  regexes_.push_back(new Regex(regex, flag_));
+  regexes_.back()->expr_info().eop->set_id(id);
+  delete dfa_;
+  dfa_ = NULL;
+  olevel_ = Regen::Options::Onone;
+  dfa_failure_ = false;
+  return id;
+}
+
+/* unite the patterns' expressions. only the first positions of the union
+ * are needed, the patterns' own follow positions are left as they are. */
+void RegexSet::Build() const
+{
+  expr_info_ = ExprInfo();
+  expr_info_.pattern_num = regexes_.size();
+  expr_info_.byte_class.Clear();
+  expr_info_.byte_class.Refine(flag_.delimiter());
+  Expr *root = NULL;
+  for (std::size_t i = 0; i < regexes_.size(); i++) {
+    const ExprInfo &info = regexes_[i]->expr_info();
+    ByteClassVisitor::Fill(info.expr_root, &expr_info_.byte_class);
+    expr_info_.involve |= info.involve;
+    if (root == NULL) {
+      root = info.expr_root;
+      expr_info_.min_length = info.min_length;
+      expr_info_.max_length = info.max_length;
+    } else {
+      Expr *lhs = root;
+      root = pool_.alloc<Union>(lhs, info.expr_root);
+      root->first() = lhs->first();
+      root->first().insert(info.expr_root->first().begin(), info.expr_root->first().end());
+      expr_info_.min_length = std::min(expr_info_.min_length, info.min_length);
+      expr_info_.max_length = std::max(expr_info_.max_length, info.max_length);
+    }
+  }
+  expr_info_.expr_root = expr_info_.orig_root = root;
+  dfa_ = new DFA(flag_);
+  dfa_->set_expr_info(expr_info_);
+}
+
+bool RegexSet::Compile(Regen::Options::CompileFlag olevel)
+{
+  if (olevel == Regen::Options::Onone || olevel_ >= olevel || regexes_.empty()) return true;
+  if (dfa_ == NULL) Build();
+  if (!dfa_failure_ && !dfa_->Complete()) {
+    /* patterns add up, and so does the limit. states beyond it are built
+     * on demand while matching. */
+    std::size_t limit = flag_.state_limit() + flag_.state_limit() / 10 * regexes_.size();
+    if (flag_.state_budget() != 0) limit = std::min(limit, flag_.state_budget());
+    dfa_failure_ = !dfa_->Construct(limit);
+    if (!dfa_failure_) dfa_->Minimize();
+  }
+  if (dfa_failure_) return false;
+
+  if (!dfa_->Compile(olevel)) {
+    olevel_ = dfa_->olevel();
+  } else {
+    olevel_ = olevel;
+  }
+  return olevel_ == olevel;
+}
+
+bool RegexSet::Match(const Regen::StringPiece& string, std::vector<std::size_t> *ids) const
+{
+  ids->clear();
+  if (regexes_.empty()) return false;
+  if (dfa_ == NULL) Build();
+  return dfa_->MatchSet(string, ids);
+}
+
+} // namespace regen
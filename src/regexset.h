@@ -0,0 +1,35 @@
+#ifndef REGEN_REGEXSET_H_
+#define REGEN_REGEXSET_H_
+
+#include "regex.h"
+
+namespace regen {
+
+/* several patterns matched in one pass. each pattern ends with an EOP
+ * tagged with its index, and the patterns are united into one DFA whose
+ * states know which of them they accept (DFA::MatchSet). */
+class RegexSet {
+public:
+  RegexSet(const Regen::Options = Regen::Options::NoParseFlags);
+  ~RegexSet();
+  std::size_t Add(const Regen::StringPiece& regex);
+  std::size_t size() const { return regexes_.size(); }
+  bool Compile(Regen::Options::CompileFlag olevel = Regen::Options::O3);
+  bool Match(const Regen::StringPiece& string, std::vector<std::size_t> *ids) const;
+  Regen::Options::CompileFlag olevel() const { return olevel_; }
+
+private:
+  void Build() const;
+  Regen::Options flag_;
+  std::vector<Regex*> regexes_;
+  mutable ExprInfo expr_info_;
+  mutable ExprPool pool_;
+  Regen::Options::CompileFlag olevel_;
+  bool dfa_failure_;
+  mutable DFA *dfa_;
+  DISALLOW_COPY_AND_ASSIGN(RegexSet);
+};
+
+} // namespace regen
+
+#endif // REGEN_REGEXSET_H_
@@ -1,16 +1,24 @@
 #ifdef REGEN_ENABLE_PARALLEL
 #include "sfa.h"
-#include <boost/thread.hpp>
-#include <boost/bind.hpp>
 
 namespace regen {
 
 SFA::SFA(Expr *expr_root, const std::vector<StateExpr*> &state_exprs, std::size_t thread_num):
     nfa_size_(state_exprs.size()),
     dfa_size_(0),
-    thread_num_(thread_num)
+    dfa_(NULL),
+    thread_num_(0),
+    parallel_threshold_(DefaultParallelThreshold),
+    cache_size_(DefaultCacheSize),
+    sticky_accept_(false),
+    pool_(NULL)
 {
+  this->thread_num(thread_num);
+
   typedef std::set<StateExpr*> NFA;
+  ByteClass &byte_class = expr_info_.byte_class;
+  byte_class.Clear();
+  ByteClassVisitor::Fill(expr_root, &byte_class);
   fa_accepts_.resize(nfa_size_);
   for (NFA::iterator i = expr_root->transition().first.begin(); i != expr_root->transition().first.end(); ++i) {
     start_states_.insert((*i)->state_id());
@@ -35,7 +43,7 @@ SFA::SFA(Expr *expr_root, const std::vector<StateExpr*> &state_exprs, std::size_
     sst = queue.front();
     sst_.push_back(sst);
     queue.pop();
-    std::vector<SSTransition> transition(256);
+    std::vector<SSTransition> transition(byte_class.num);
 
     iter = sst.begin();
     while (iter != sst.end()) {
@@ -47,7 +55,7 @@ SFA::SFA(Expr *expr_root, const std::vector<StateExpr*> &state_exprs, std::size_
         switch (s->type()) {
           case Expr::kLiteral: {
             Literal* literal = static_cast<Literal*>(s);
-            unsigned char index = (unsigned char)literal->literal();
+            unsigned char index = byte_class.map[(unsigned char)literal->literal()];
             for (NFA::iterator ni = next.begin(); ni != next.end(); ++ni) {
               transition[index][start].insert((*ni)->state_id());
             }
@@ -55,19 +63,19 @@ SFA::SFA(Expr *expr_root, const std::vector<StateExpr*> &state_exprs, std::size_
           }
           case Expr::kCharClass: {
             CharClass* charclass = static_cast<CharClass*>(s);
-            for (int c = 0; c < 256; c++) {
-              if (charclass->Involve(static_cast<unsigned char>(c))) {
+            for (std::size_t k = 0; k < byte_class.num; k++) {
+              if (charclass->Involve(byte_class.rep[k])) {
                 for (NFA::iterator ni = next.begin(); ni != next.end(); ++ni) {
-                  transition[c][start].insert((*ni)->state_id());
+                  transition[k][start].insert((*ni)->state_id());
                 }
               }
             }
             break;
           }
           case Expr::kDot: {
-            for (int c = 0; c < 256; c++) {
+            for (std::size_t k = 0; k < byte_class.num; k++) {
               for (NFA::iterator ni = next.begin(); ni != next.end(); ++ni) {
-                transition[c][start].insert((*ni)->state_id());
+                transition[k][start].insert((*ni)->state_id());
               }
             }
             break;
@@ -84,11 +92,12 @@ SFA::SFA(Expr *expr_root, const std::vector<StateExpr*> &state_exprs, std::size_
     }
 
     State &state = get_new_state();
+    std::vector<state_t> class_transition(byte_class.num);
     
-    for (std::size_t c = 0; c < 256; c++) {
-      SSTransition &next = transition[c];
+    for (std::size_t k = 0; k < byte_class.num; k++) {
+      SSTransition &next = transition[k];
       if (next.empty()) {
-        state[c] = REJECT;
+        class_transition[k] = REJECT;
         state.dst_states.insert(REJECT);
         continue;
       }
@@ -96,19 +105,29 @@ SFA::SFA(Expr *expr_root, const std::vector<StateExpr*> &state_exprs, std::size_
         sfa_map[next] = sfa_id++;
         queue.push(next);
       }
-      state[c] = sfa_map[next];
+      class_transition[k] = sfa_map[next];
       state.dst_states.insert(sfa_map[next]);
     }
+    for (std::size_t c = 0; c < 256; c++) {
+      state[c] = class_transition[byte_class.map[c]];
+    }
   }
 
-  complete_ = true;
+  Finalize();
 }
 
 SFA::SFA(const NFA &nfa, std::size_t thread_num):
     nfa_size_(nfa.size()),
     dfa_size_(0),
-    thread_num_(thread_num)
+    dfa_(NULL),
+    thread_num_(0),
+    parallel_threshold_(DefaultParallelThreshold),
+    cache_size_(DefaultCacheSize),
+    sticky_accept_(false),
+    pool_(NULL)
 {
+  this->thread_num(thread_num);
+
   fa_accepts_.resize(nfa_size_);
   for (NFA::const_iterator state_iter = nfa.begin(); state_iter != nfa.end(); ++state_iter)
     fa_accepts_[(*state_iter).id] = (*state_iter).accept;
@@ -163,19 +182,33 @@ SFA::SFA(const NFA &nfa, std::size_t thread_num):
     }
   }
 
-  complete_ = true;
+  Finalize();
 }
 
-SFA::SFA(const DFA &dfa, std::size_t thread_num):
+SFA::SFA(const DFA &dfa, std::size_t thread_num, std::size_t limit):
+    DFA(dfa.flag()),
     nfa_size_(0),
     dfa_size_(dfa.size()),
-    thread_num_(thread_num)
+    dfa_(&dfa),
+    thread_num_(0),
+    parallel_threshold_(DefaultParallelThreshold),
+    cache_size_(DefaultCacheSize),
+    sticky_accept_(false),
+    pool_(NULL)
 {
+  this->thread_num(thread_num);
+  /* chunks start at arbitrary offsets, so the keyword filter of the
+   * original DFA does not hold for them. */
+  flag_.filtered_match(false);
   if (!dfa.Complete()) return;
   
+  /* each chunk ends somewhere inside the input, so accept states of a
+   * partial matching DFA must stay accepted until the last chunk. */
+  sticky_accept_ = !flag_.suffix_match();
+  const ByteClass &byte_class = expr_info_.byte_class = dfa.expr_info().byte_class;
   fa_accepts_.resize(dfa.size());
   for (DFA::const_iterator s = dfa.begin(); s != dfa.end(); ++s) {
-    fa_accepts_[s->id] = s->accept;
+    fa_accepts_[s->id] = dfa.AcceptAtEnd(s->id);
   }
 
   start_states_.insert(0);
@@ -197,52 +230,109 @@ SFA::SFA(const DFA &dfa, std::size_t thread_num):
 
   while (!queue.empty()) {
     ssdt = queue.front();
-    SSTransition sst;
+    stitch_table_.resize(stitch_table_.size() + dfa_size_, REJECT);
+    state_t *stitch = &stitch_table_[stitch_table_.size() - dfa_size_];
     for (iter = ssdt.begin(); iter != ssdt.end(); ++iter) {
-      sst[(*iter).first].insert((*iter).second);
+      stitch[(*iter).first] = (*iter).second;
     }
-    sst_.push_back(sst);
     queue.pop();
-    std::vector<SSDTransition> transition(256);
+    std::vector<SSDTransition> transition(byte_class.num);
     
     iter = ssdt.begin();
     while (iter != ssdt.end()) {
       state_t start = (*iter).first;
       state_t current = (*iter).second;
       const DFA::Transition &trans = dfa.GetTransition(current);
-      for (std::size_t c = 0; c < 256; c++) {
-        state_t next = trans[c];
+      if (sticky_accept_ && dfa.IsAcceptState(current)) {
+        for (std::size_t k = 0; k < byte_class.num; k++) {
+          transition[k][start] = current;
+        }
+        ++iter;
+        continue;
+      }
+      for (std::size_t k = 0; k < byte_class.num; k++) {
+        state_t next = trans[byte_class.rep[k]];
         if (next != DFA::REJECT) {
-          transition[c][start] = next;
+          transition[k][start] = next;
         }
       }
       ++iter;
     }
 
     State &state = get_new_state();
+    std::vector<state_t> class_transition(byte_class.num);
     
-    for (std::size_t c = 0; c < 256; c++) {
-      SSDTransition &next = transition[c];
+    for (std::size_t k = 0; k < byte_class.num; k++) {
+      SSDTransition &next = transition[k];
       if (next.empty()) {
-        state[c] = REJECT;
+        class_transition[k] = REJECT;
         state.dst_states.insert(REJECT);
         continue;
       }
 
       if (sfa_map.find(next) == sfa_map.end()) {
+        if (sfa_id >= limit) {
+          /* too large, build states on demand. */
+          states_.clear();
+          transition_.clear();
+          stitch_table_.clear();
+          return;
+        }
         sfa_map[next] = sfa_id++;
         queue.push(next);
       }
-      state[c] = sfa_map[next];
+      class_transition[k] = sfa_map[next];
       state.dst_states.insert(sfa_map[next]);
     }
+    for (std::size_t c = 0; c < 256; c++) {
+      state[c] = class_transition[byte_class.map[c]];
+    }
   }
 
-  complete_ = true;
+  Finalize();
+}
+
+void SFA::thread_num(std::size_t thread_num)
+{
+  if (thread_num == 0) thread_num = boost::thread::hardware_concurrency();
+  if (thread_num == 0) thread_num = 1;
+  if (thread_num == thread_num_) return;
+  boost::mutex::scoped_lock lock(match_mutex_);
+  delete pool_;
+  pool_ = thread_num > 1 ? new WorkerPool(thread_num) : NULL;
+  thread_num_ = thread_num;
+  caches_.resize(thread_num_);
+}
+
+bool SFA::Compile(Regen::Options::CompileFlag olevel)
+{
+  /* do not replace the compiled code under running chunks. */
+  boost::mutex::scoped_lock lock(match_mutex_);
+  return DFA::Compile(olevel);
+}
+
+void SFA::RunTask(void *context, std::size_t task_id, std::size_t worker_id)
+{
+  const MatchContext *ctx = static_cast<const MatchContext*>(context);
+  TaskArg targ;
+  targ.string = ctx->Chunk(task_id);
+  if (ctx->sfa->flag_.reverse_match()) {
+    targ.task_id = ctx->chunk_num - task_id - 1;
+  } else {
+    targ.task_id = task_id;
+  }
+  targ.worker_id = worker_id;
+  ctx->sfa->MatchTask(targ);
 }
 
 void SFA::MatchTask(TaskArg targ) const
 {
+  if (flag_.reverse_match()) targ.string.reverse();
+
+  if (!complete_) {
+    LazyMatchTask(targ);
+    return;
+  }
 
   if (olevel_ >= Regen::Options::O1) {
     partial_results_[targ.task_id] = CompiledMatch(targ.string._udata(), NULL, 0);
@@ -250,79 +340,192 @@ void SFA::MatchTask(TaskArg targ) const
   }
   
   state_t state = 0;
-  const unsigned char* str = targ.string.ubegin(), * end = targ.string.ubegin();
-  
-  while (str != end && (state = transition_[state][*str++]) != DFA::REJECT);
+  const unsigned char* str = targ.string.ubegin(), * end = targ.string.uend();
+  const int sign = flag_.reverse_match() ? -1 : 1;
+
+  while (str != end && (state = transition_[state][*str]) != DFA::REJECT) str += sign;
 
   partial_results_[targ.task_id] = state;
   return;
 }
 
+DFA::state_t SFA::LazyState(LazyCache *cache, const StateMap &map) const
+{
+  std::map<StateMap, state_t>::iterator iter = cache->ids.find(map);
+  if (iter != cache->ids.end()) return iter->second;
+  state_t id = cache->maps.size();
+  iter = cache->ids.insert(std::make_pair(map, id)).first;
+  cache->maps.push_back(&iter->first);
+  cache->transition.resize(cache->transition.size() + expr_info_.byte_class.num, UNDEF);
+  return id;
+}
+
+void SFA::LazyMatchTask(const TaskArg &targ) const
+{
+  LazyCache &cache = caches_[targ.worker_id];
+  const ByteClass &byte_class = expr_info_.byte_class;
+  const std::size_t state_size = (byte_class.num + 2 * dfa_size_) * sizeof(state_t);
+  const std::size_t limit = std::max(cache_size_ / state_size, (std::size_t)2);
+  StateMap map(dfa_size_), next(dfa_size_);
+  for (std::size_t i = 0; i < dfa_size_; i++) map[i] = i;
+
+  state_t state = LazyState(&cache, map);
+  const unsigned char* str = targ.string.ubegin(), * end = targ.string.uend();
+  const int sign = flag_.reverse_match() ? -1 : 1;
+
+  for (; str != end; str += sign) {
+    const unsigned char k = byte_class.map[*str];
+    state_t next_state = cache.transition[state * byte_class.num + k];
+    if (next_state == UNDEF) {
+      const StateMap &current = *cache.maps[state];
+      bool alive = false;
+      for (std::size_t i = 0; i < dfa_size_; i++) {
+        state_t s = current[i];
+        if (s == REJECT || (sticky_accept_ && dfa_->IsAcceptState(s))) {
+          next[i] = s;
+        } else {
+          next[i] = dfa_->GetTransition(s)[byte_class.rep[k]];
+        }
+        alive |= next[i] != REJECT;
+      }
+      if (!alive) {
+        next_state = REJECT;
+      } else if (cache.maps.size() >= limit) {
+        /* cache is full. flush it, and rebuild from the current state. */
+        map = current;
+        cache.ids.clear();
+        cache.maps.clear();
+        cache.transition.clear();
+        state = LazyState(&cache, map);
+        next_state = LazyState(&cache, next);
+      } else {
+        next_state = LazyState(&cache, next);
+      }
+      cache.transition[state * byte_class.num + k] = next_state;
+    }
+    if ((state = next_state) == REJECT) break;
+  }
+
+  if (state == REJECT) {
+    partial_maps_[targ.task_id].clear();
+  } else {
+    partial_maps_[targ.task_id] = *cache.maps[state];
+  }
+}
+
+/* DFA state reached by the chunk of `task_id', entered with `state'. */
+DFA::state_t SFA::Stitch(std::size_t task_id, state_t state) const
+{
+  if (!complete_) {
+    const StateMap &map = partial_maps_[task_id];
+    return map.empty() ? REJECT : map[state];
+  }
+  state_t pstate = partial_results_[task_id];
+  if (pstate == REJECT) return REJECT;
+  return stitch_table_[pstate * dfa_size_ + state];
+}
+
 bool SFA::Match(const Regen::StringPiece &string, Regen::StringPiece *result) const
 {
-  if (!complete_) return false;
+  if (!complete_) {
+    if (dfa_ == NULL) return false;
+    if (!dfa_->Complete()) return dfa_->Match(string, result);
+  }
 
-  std::size_t thread_num = thread_num_;
-  if (string.size() <= 2)  {
-    thread_num = 1;
-  } else if (string.size() < thread_num) {
-    thread_num = string.size();
+  /* the input is cut into many chunks, so that idle threads can take
+   * over the chunks of a slow one. */
+  std::size_t chunk_num = 1;
+  if (string.size() < parallel_threshold_ || string.size() <= 2) {
+    /* thread dispatching does not pay for short inputs. */
+    if (dfa_ != NULL) return dfa_->Match(string, result);
+  } else if (thread_num_ > 1) {
+    chunk_num = std::min(thread_num_ * ChunksPerThread, string.size() / MinChunkLength);
+    chunk_num = std::max(chunk_num, thread_num_);
   }
-  partial_results_.resize(thread_num);
-  boost::thread *threads[thread_num];
-  std::size_t task_string_length = string.size() / thread_num;
-  std::size_t remainder_length = string.size() % thread_num;
-  TaskArg targ;
-  const char *str = string.begin();
 
-  for (std::size_t i = 0; i < thread_num; i++) {
-    if (i == thread_num - 1) task_string_length += remainder_length;
-    targ.string.set(str, task_string_length);
-    if (flag_.reverse_match()) {
-      targ.task_id = thread_num - i - 1;
-    } else {
-      targ.task_id = i;
-    }
-    threads[targ.task_id] = new boost::thread(
-        boost::bind(
-            boost::bind(&regen::SFA::MatchTask, this, _1),
-            targ));
-    str += task_string_length;
+  boost::mutex::scoped_lock lock(match_mutex_);
+  MatchContext ctx;
+  ctx.sfa = this;
+  ctx.begin = string.begin();
+  ctx.length = string.size();
+  ctx.chunk_num = chunk_num;
+  ctx.chunk_length = string.size() / chunk_num;
+  if (complete_) {
+    partial_results_.resize(chunk_num);
+  } else {
+    partial_maps_.resize(chunk_num);
   }
 
-  std::set<state_t> states, next_states;
-  states = start_states_;
-  state_t pstate;
+  if (chunk_num == 1) {
+    RunTask(&ctx, 0, 0);
+  } else {
+    pool_->Run(&SFA::RunTask, &ctx, chunk_num);
+  }
 
-  for (std::size_t i = 0; i < thread_num; i++) {
-    threads[i]->join();
-    if ((pstate = partial_results_[i]) == DFA::REJECT) {
-      states.clear();
-      break;
+  /* match position of partial matching is found by rerunning the DFA
+   * over the chunk where the match ends, entered with the DFA state
+   * stitched from the preceding chunks. */
+  bool match = false;
+  if (dfa_ != NULL) {
+    const bool rescan = result != NULL && !flag_.suffix_match();
+    std::size_t rescan_task = chunk_num - 1;
+    state_t state = start_state(), entry_state = state;
+    for (std::size_t i = 0; i < chunk_num; i++) {
+      entry_state = state;
+      if ((state = Stitch(i, state)) == DFA::REJECT) return false;
+      if (rescan && dfa_->IsAcceptState(state)) {
+        /* accept states are sticky, the first one is the leftmost. */
+        rescan_task = i;
+        break;
+      }
+    }
+
+    if (rescan) {
+      std::size_t chunk = flag_.reverse_match() ? chunk_num - rescan_task - 1 : rescan_task;
+      const Regen::StringPiece chunk_string = ctx.Chunk(chunk);
+      if (flag_.reverse_match()) {
+        return dfa_->Match(Regen::StringPiece(string.begin(), chunk_string.end()), result, entry_state);
+      } else {
+        return dfa_->Match(Regen::StringPiece(chunk_string.begin(), string.end()), result, entry_state);
+      }
+    }
+    match = fa_accepts_[state];
+  } else {
+    std::set<state_t> states, next_states;
+    states = start_states_;
+    state_t pstate;
+
+    for (std::size_t i = 0; i < chunk_num; i++) {
+      if ((pstate = partial_results_[i]) == DFA::REJECT) {
+        states.clear();
+        break;
+      }
+      for (std::set<state_t>::iterator i = states.begin(); i != states.end(); ++i) {
+        SSTransition::const_iterator iter = sst_[pstate].find(*i);
+        if (iter == sst_[pstate].end()) continue;
+        next_states.insert((*iter).second.begin(), (*iter).second.end());
+      }
+      states.swap(next_states);
+      if (states.empty()) break;
+      next_states.clear();
     }
+
     for (std::set<state_t>::iterator i = states.begin(); i != states.end(); ++i) {
-      SSTransition::const_iterator iter = sst_[pstate].find(*i);
-      if (iter == sst_[pstate].end()) continue;
-      next_states.insert((*iter).second.begin(), (*iter).second.end());
+      if (fa_accepts_[*i]) {
+        match = true;
+        break;
+      }
     }
-    states.swap(next_states);
-    if (states.empty()) break;
-    next_states.clear();
   }
 
-  bool match = false;
-  for (std::set<state_t>::iterator i = states.begin(); i != states.end(); ++i) {
-    if (fa_accepts_[*i]) {
-      match = true;
-      break;
+  if (match && result != NULL && flag_.suffix_match()) {
+    if (flag_.reverse_match()) {
+      result->set_begin(string.begin());
+    } else {
+      result->set_end(string.end());
     }
   }
 
-  for (std::size_t i = 0; i < thread_num; i++) {
-    threads[i]->join();
-    delete threads[i];
-  }
-  
   return match;
 }
 
@@ -5,8 +5,10 @@
 #include "regex.h"
 #include "util.h"
 #include "expr.h"
+#include "exprutil.h"
 #include "nfa.h"
 #include "dfa.h"
+#include "workerpool.h"
 
 class Regex;
 
@@ -16,26 +18,72 @@ class SFA: public DFA {
 public:
   SFA(Expr* expr_root, const std::vector<StateExpr*> &state_exprs, std::size_t thread_num = 2);
   SFA(const NFA &nfa, std::size_t thread_num = 2);  
-  SFA(const DFA &dfa, std::size_t thread_num = 2);
+  SFA(const DFA &dfa, std::size_t thread_num = 2, std::size_t limit = std::numeric_limits<size_t>::max());
+  ~SFA() { delete pool_; }
   std::size_t thread_num() const { return thread_num_; }
-  void thread_num(std::size_t thread_num) { thread_num_ = thread_num; }
+  void thread_num(std::size_t thread_num);
+  /* inputs shorter than parallel_threshold are matched sequentially. */
+  std::size_t parallel_threshold() const { return parallel_threshold_; }
+  void parallel_threshold(std::size_t threshold) { parallel_threshold_ = threshold; }
+  static const std::size_t DefaultParallelThreshold = Regen::Options::DefaultParallelThreshold;
+  /* when the SFA does not fit in the state limit, its states are built on
+   * demand. each thread caches at most cache_size bytes of them, and
+   * starts over from the current state when the cache is full. */
+  std::size_t cache_size() const { return cache_size_; }
+  void cache_size(std::size_t size) { cache_size_ = size; }
+  static const std::size_t DefaultCacheSize = 8 << 20;
   typedef std::map<state_t, std::set<state_t> > SSTransition;
   typedef std::map<state_t, state_t> SSDTransition;
   bool Minimize() { return true; }
+  bool Compile(Regen::Options::CompileFlag olevel = Regen::Options::O2);
   bool Match(const Regen::StringPiece& string, Regen::StringPiece* result = NULL) const;
   struct TaskArg {
     Regen::StringPiece string;
     std::size_t task_id;
+    std::size_t worker_id;
   };
 private:
+  static const std::size_t ChunksPerThread = 16;
+  static const std::size_t MinChunkLength = 64 << 10;
+  struct MatchContext {
+    const SFA *sfa;
+    const char *begin;
+    std::size_t chunk_length;
+    std::size_t chunk_num;
+    std::size_t length;
+    /* i-th chunk of the input, in memory order. */
+    Regen::StringPiece Chunk(std::size_t i) const {
+      std::size_t len = i == chunk_num - 1 ? length - chunk_length * i : chunk_length;
+      return Regen::StringPiece(begin + chunk_length * i, len);
+    }
+  };
+  typedef std::vector<state_t> StateMap;
+  struct LazyCache {
+    std::map<StateMap, state_t> ids;
+    std::vector<const StateMap *> maps;
+    std::vector<state_t> transition; // indexed by state * byte class num + class
+  };
+  static void RunTask(void *context, std::size_t task_id, std::size_t worker_id);
   void MatchTask(TaskArg targ) const;
+  void LazyMatchTask(const TaskArg &targ) const;
+  state_t LazyState(LazyCache *cache, const StateMap &map) const;
+  state_t Stitch(std::size_t task_id, state_t state) const;
   mutable std::vector<state_t> partial_results_;
+  mutable std::vector<StateMap> partial_maps_;
+  mutable std::vector<LazyCache> caches_;
+  mutable boost::mutex match_mutex_;
   std::size_t nfa_size_;
   std::size_t dfa_size_;
+  const DFA *dfa_;
   std::set<state_t> start_states_;
   std::size_t thread_num_;
+  std::size_t parallel_threshold_;
+  std::size_t cache_size_;
+  bool sticky_accept_;
+  WorkerPool *pool_;
   std::vector<bool> fa_accepts_;
   std::vector<SSTransition> sst_;
+  std::vector<state_t> stitch_table_;
 };
 
 } // namespace regen
@@ -1,5 +1,9 @@
 #include "gtest/gtest.h"
+#include <algorithm>
 #include "../regen.h"
+#ifdef REGEN_ENABLE_PARALLEL
+#include <boost/thread.hpp>
+#endif
 
 struct testcase {
   testcase(std::string regex_, std::string text_, bool result_): regex(regex_), text(text_), result(result_) {}
@@ -128,3 +132,460 @@ GENTEST(O1)
 GENTEST(O2)
 GENTEST(O3)
 #undef GENTEST
+
+#define GENTEST(OLEVEL)                                             \
+  TEST(SetMatchTest, OLEVEL) {                                      \
+    const std::size_t TESTNUM = sizeof(test) / sizeof(testcase);    \
+    RegenSet set;                                                   \
+    for (std::size_t i = 0; i < TESTNUM; i++) {                     \
+      ASSERT_EQ(set.Add(test[i].regex), i);                         \
+    }                                                               \
+    set.Compile(Regen::Options::OLEVEL);                            \
+    std::vector<std::size_t> ids;                                   \
+    for (std::size_t i = 0; i < TESTNUM; i++) {                     \
+      set.Match(test[i].text, &ids);                                \
+      ASSERT_EQ(std::binary_search(ids.begin(), ids.end(), i),     \
+                test[i].result);                                    \
+    }                                                               \
+    Regen::Options opt;                                             \
+    opt.partial_match(true);                                        \
+    RegenSet partial(opt);                                          \
+    partial.Add("abc");                                             \
+    partial.Add("b+c");                                             \
+    partial.Add("x");                                               \
+    partial.Compile(Regen::Options::OLEVEL);                        \
+    ASSERT_TRUE(partial.Match("zzabbczz", &ids));                   \
+    ASSERT_EQ(1u, ids.size());                                      \
+    ASSERT_EQ(1u, ids[0]);                                          \
+    ASSERT_TRUE(partial.Match("xabc", &ids));                       \
+    ASSERT_EQ(3u, ids.size());                                      \
+    ASSERT_FALSE(partial.Match("zzz", &ids));                       \
+  }
+GENTEST(O0)
+GENTEST(O1)
+GENTEST(O2)
+GENTEST(O3)
+#undef GENTEST
+
+#define GENTEST(OLEVEL)                                             \
+  TEST(StreamMatchTest, OLEVEL) {                                   \
+    const std::size_t TESTNUM = sizeof(test) / sizeof(testcase);    \
+    for (std::size_t i = 0; i < TESTNUM; i++) {                     \
+      Regen re(test[i].regex);                                      \
+      re.Compile(Regen::Options::OLEVEL);                           \
+      Regen::Stream stream(re);                                     \
+      const std::string text(test[i].text);                         \
+      for (std::size_t j = 0; j < text.size(); j += 3) {            \
+        if (!stream.Feed(text.substr(j, 3))) break;                 \
+      }                                                             \
+      ASSERT_EQ(stream.End(), test[i].result);                      \
+    }                                                               \
+    Regen::Options opt;                                             \
+    opt.partial_match(true);                                        \
+    Regen re("ab+c", opt);                                          \
+    re.Compile(Regen::Options::OLEVEL);                             \
+    Regen::Stream stream(re);                                       \
+    ASSERT_TRUE(stream.Feed("xxa"));                                \
+    ASSERT_TRUE(stream.Feed("bb"));                                 \
+    stream.Feed("cz");                                              \
+    ASSERT_TRUE(stream.End());                                      \
+    ASSERT_EQ(6u, stream.match_end());                              \
+    Regen reverse("abc", Regen::Options::ReverseMatch);             \
+    reverse.Compile(Regen::Options::OLEVEL);                        \
+    Regen::Stream rstream(reverse);                                 \
+    ASSERT_FALSE(rstream.Feed("abc"));                              \
+    ASSERT_FALSE(rstream.End());                                    \
+    rstream.Reset();                                                \
+    ASSERT_FALSE(rstream.Feed("cba"));                              \
+    ASSERT_FALSE(rstream.End());                                    \
+  }
+GENTEST(O0)
+GENTEST(O1)
+GENTEST(O2)
+GENTEST(O3)
+#undef GENTEST
+
+#define GENTEST(OLEVEL)                                             \
+  TEST(ConsumeTest, OLEVEL) {                                       \
+    Regen word("[a-z]+"), space(" *"), number("[0-9]+");           \
+    word.Compile(Regen::Options::OLEVEL);                           \
+    space.Compile(Regen::Options::OLEVEL);                          \
+    number.Compile(Regen::Options::OLEVEL);                         \
+    const std::string text("abc  12 de");                           \
+    Regen::StringPiece input(text), token;                          \
+    ASSERT_FALSE(number.Consume(&input, &token));                   \
+    ASSERT_EQ(text.data(), input.data());                           \
+    ASSERT_TRUE(word.Consume(&input, &token));                      \
+    ASSERT_EQ("abc", token.as_string());                            \
+    ASSERT_TRUE(space.Consume(&input));                             \
+    ASSERT_TRUE(number.Consume(&input, &token));                    \
+    ASSERT_EQ("12", token.as_string());                             \
+    ASSERT_TRUE(space.Consume(&input, &token));                     \
+    ASSERT_TRUE(space.Consume(&input, &token));                     \
+    ASSERT_TRUE(token.empty());                                     \
+    ASSERT_TRUE(Regen::Consume(&input, "d|de", &token));            \
+    ASSERT_EQ("de", token.as_string());                             \
+    ASSERT_TRUE(input.empty());                                     \
+  }
+GENTEST(O0)
+GENTEST(O1)
+GENTEST(O2)
+GENTEST(O3)
+#undef GENTEST
+
+#define GENTEST(OLEVEL)                                             \
+  TEST(SaveLoadTest, OLEVEL) {                                      \
+    const std::size_t TESTNUM = sizeof(test) / sizeof(testcase);    \
+    for (std::size_t i = 0; i < TESTNUM; i++) {                     \
+      Regen re(test[i].regex);                                      \
+      re.Compile(Regen::Options::OLEVEL);                           \
+      std::string image;                                            \
+      if (!re.Save(&image)) continue;                               \
+      Regen *loaded = Regen::Load(image, Regen::Options::OLEVEL);   \
+      ASSERT_TRUE(loaded != NULL);                                  \
+      ASSERT_EQ(loaded->Match(test[i].text), test[i].result);       \
+      delete loaded;                                                \
+      image.resize(image.size() - 1);                               \
+      ASSERT_TRUE(Regen::Load(image) == NULL);                      \
+    }                                                               \
+  }
+GENTEST(O0)
+GENTEST(O1)
+GENTEST(O2)
+GENTEST(O3)
+#undef GENTEST
+
+TEST(CacheTest, LRU) {
+  Regen::CacheStats before = Regen::cache_stats();
+  for (int i = 0; i < 10; i++) {
+    ASSERT_TRUE(Regen::FullMatch("abcabc", "(abc)+(cache)?"));
+  }
+  Regen::CacheStats after = Regen::cache_stats();
+  ASSERT_EQ(before.misses + 1, after.misses);
+  ASSERT_EQ(before.hits + 9, after.hits);
+  Regen::cache_budget(0);
+  ASSERT_EQ(0u, Regen::cache_stats().entries);
+  ASSERT_FALSE(Regen::FullMatch("abcab", "(abc)+(cache)?"));
+  ASSERT_EQ(0u, Regen::cache_stats().memory);
+  Regen::cache_budget(before.budget);
+}
+
+#ifdef REGEN_ENABLE_PARALLEL
+#define GENTEST(OLEVEL)                                             \
+  TEST(ParallelMatchTest, OLEVEL) {                                 \
+    std::string text(3 << 20, 'x');                                 \
+    text.replace(text.size() / 2, 3, "abc");                        \
+    Regen::Options opt;                                             \
+    opt.parallel_match(true);                                       \
+    opt.thread_num(4);                                              \
+    Regen full(".*abc.*", opt);                                     \
+    full.Compile(Regen::Options::OLEVEL);                           \
+    ASSERT_TRUE(full.Match(text));                                  \
+    ASSERT_FALSE(full.Match(text + "\n"));                          \
+    opt.partial_match(true);                                        \
+    Regen partial("abc", opt);                                      \
+    partial.Compile(Regen::Options::OLEVEL);                        \
+    ASSERT_TRUE(partial.Match(text));                               \
+    Regen::StringPiece result;                                      \
+    ASSERT_TRUE(partial.Match(text, &result));                      \
+    ASSERT_EQ(text.data() + text.size() / 2 + 3, result.end());     \
+    text.replace(text.size() / 2, 3, "xyz");                        \
+    ASSERT_FALSE(partial.Match(text));                              \
+    ASSERT_FALSE(full.Match(text));                                 \
+    /* split inputs far below the default threshold as well. */     \
+    opt.parallel_threshold(4 << 10);                                \
+    Regen small("abc", opt);                                        \
+    small.Compile(Regen::Options::OLEVEL);                          \
+    std::string line(64 << 10, 'x');                                \
+    ASSERT_FALSE(small.Match(line));                                \
+    line.replace(40 << 10, 3, "abc");                               \
+    ASSERT_TRUE(small.Match(line, &result));                        \
+    ASSERT_EQ(line.data() + (40 << 10) + 3, result.end());          \
+  }
+GENTEST(O0)
+GENTEST(O1)
+GENTEST(O2)
+GENTEST(O3)
+#undef GENTEST
+
+TEST(ParallelMatchTest, LazySFA) {
+  /* the DFA has 24 states, its SFA 304: over the limit, the SFA states
+   * are built while matching. */
+  const char *pattern = "(a|b)*a(a|b){3}";
+  std::string text;
+  for (std::size_t i = 0; i < 3000; i++) {
+    text += i % 4 == 3 && i % 29 != 27 ? (i % 3 ? 'c' : '\n') : "ab"[i * 5 % 11 / 6];
+  }
+  Regen::Options opt;
+  opt.partial_match(true);
+  opt.state_limit(100);
+  Regen sequential(pattern, opt);
+  sequential.Compile(Regen::Options::O1);
+  opt.parallel_match(true);
+  opt.thread_num(4);
+  opt.parallel_threshold(1);
+  Regen parallel(pattern, opt);
+  parallel.Compile(Regen::Options::O1);
+  ASSERT_EQ(Regen::FullDFA, parallel.tier());
+  for (std::size_t i = 0; i + 60 <= text.size(); i += 7) {
+    Regen::StringPiece string(text.data() + i, 60), r1, r2;
+    ASSERT_EQ(sequential.Match(string, &r1), parallel.Match(string, &r2));
+    ASSERT_EQ(r1.end(), r2.end());
+  }
+}
+
+TEST(ParallelMatchTest, Tiers) {
+  /* without the whole DFA there is no SFA: the input is matched by one
+   * thread. */
+  const char *patterns[] = { "(a|b)*b(a|b){10}$", "(a|b)*a(a|b){12}" };
+  const Regen::Tier tiers[] = { Regen::LazyDFA, Regen::BitParallelNFA };
+  std::string text;
+  for (std::size_t i = 0; i < 3000; i++) {
+    text += i % 41 == 40 ? '\n' : "ab"[i * 5 % 11 / 6];
+  }
+  for (std::size_t k = 0; k < 2; k++) {
+    Regen::Options opt;
+    opt.partial_match(true);
+    Regen sequential(patterns[k], opt);
+    sequential.Compile(Regen::Options::O1);
+    opt.parallel_match(true);
+    opt.thread_num(4);
+    opt.parallel_threshold(1);
+    Regen parallel(patterns[k], opt);
+    parallel.Compile(Regen::Options::O1);
+    ASSERT_EQ(tiers[k], parallel.tier());
+    for (std::size_t i = 0; i + 60 <= text.size(); i += 7) {
+      Regen::StringPiece string(text.data() + i, 60), r1, r2;
+      ASSERT_EQ(sequential.Match(string, &r1), parallel.Match(string, &r2));
+      ASSERT_EQ(r1.end(), r2.end());
+    }
+  }
+}
+
+struct SharedMatcher {
+  const Regen *re;
+  const std::vector<std::string> *texts;
+  const std::vector<int> *ends;
+  int *mismatch;
+  void operator()() {
+    for (int k = 0; k < 4; k++) {
+      for (std::size_t i = 0; i < texts->size(); i++) {
+        Regen::StringPiece result;
+        const std::string &text = (*texts)[(i * 7 + k) % texts->size()];
+        int end = re->Match(text, &result) ? (int)(result.end() - text.data()) : -1;
+        if (end != (*ends)[(i * 7 + k) % texts->size()]) (*mismatch)++;
+      }
+    }
+  }
+};
+
+/* one lazy DFA shared by several threads, flushed over and over. */
+TEST(SharedMatchTest, OnTheFly) {
+  std::vector<std::string> texts;
+  std::vector<int> ends;
+  Regen::Options option;
+  option.partial_match(true);
+  Regen single("(a|b)*a(a|b){9}", option);
+  srand(13);
+  for (int i = 0; i < 300; i++) {
+    std::string text;
+    for (int j = rand() % 100; j > 0; j--) text += "ab"[rand() % 2];
+    Regen::StringPiece result;
+    texts.push_back(text);
+    ends.push_back(single.Match(text, &result) ? (int)(result.end() - text.data()) : -1);
+  }
+  option.state_budget(100);
+  Regen shared("(a|b)*a(a|b){9}", option);
+  int mismatch[4] = {0, 0, 0, 0};
+  boost::thread_group threads;
+  for (int i = 0; i < 4; i++) {
+    SharedMatcher matcher = {&shared, &texts, &ends, &mismatch[i]};
+    threads.create_thread(matcher);
+  }
+  threads.join_all();
+  for (int i = 0; i < 4; i++) ASSERT_EQ(0, mismatch[i]);
+  ASSERT_LT(0u, shared.state_stats().flushes);
+}
+
+struct SharedConsumer {
+  const Regen *re;
+  const std::string *input;
+  int *tokens;
+  void operator()() {
+    Regen::StringPiece rest(*input), token;
+    while (re->Consume(&rest, &token)) (*tokens)++;
+  }
+};
+
+/* threads racing to build the prefix matching regex of Consume(). */
+TEST(SharedMatchTest, Consume) {
+  std::string input;
+  for (int i = 0; i < 200; i++) input += i % 3 ? "ab " : "cde ";
+  for (int round = 0; round < 20; round++) {
+    Regen shared("[a-z]+ ");
+    int tokens[4] = {0, 0, 0, 0};
+    boost::thread_group threads;
+    for (int i = 0; i < 4; i++) {
+      SharedConsumer consumer = {&shared, &input, &tokens[i]};
+      threads.create_thread(consumer);
+    }
+    threads.join_all();
+    for (int i = 0; i < 4; i++) ASSERT_EQ(200, tokens[i]);
+  }
+}
+#endif
+
+#define GENTEST(OLEVEL)                                             \
+  TEST(FilteredMatchTest, OLEVEL) {                                 \
+    std::string text(1 << 20, 'z');                                 \
+    for (std::size_t i = 0; i < text.size(); i += 61) text[i] = ' ';\
+    Regen::Options opt;                                             \
+    opt.partial_match(true);                                        \
+    opt.filtered_match(true);                                       \
+    Regen re("hello[a-z]+world", opt);                              \
+    re.Compile(Regen::Options::OLEVEL);                             \
+    ASSERT_FALSE(re.Match(text));                                   \
+    text.replace(text.size() / 2, 11, "helloxworld");               \
+    Regen::StringPiece result;                                      \
+    ASSERT_TRUE(re.Match(text, &result));                           \
+    ASSERT_EQ(text.data() + text.size() / 2 + 11, result.end());    \
+    text.replace(text.size() / 2, 11, "hello world");               \
+    ASSERT_FALSE(re.Match(text));                                   \
+    Regen alt("(GET|POST|PUT)[a-z]+x", opt);                        \
+    alt.Compile(Regen::Options::OLEVEL);                            \
+    ASSERT_FALSE(alt.Match(text));                                  \
+    text.replace(text.size() / 3, 8, "PUTzzzzx");                   \
+    ASSERT_TRUE(alt.Match(text, &result));                          \
+    ASSERT_EQ(text.data() + text.size() / 3 + 8, result.end());     \
+  }
+GENTEST(O0)
+GENTEST(O1)
+GENTEST(O2)
+GENTEST(O3)
+#undef GENTEST
+
+TEST(JitterTest, OnTheFly) {
+  /* (a|b)*a(a|b){12} has 2^13 states, beyond the DFA construction limit. */
+  const char *pattern = "(a|b)*a(a|b){12}";
+  std::string text;
+  srand(7);
+  for (int i = 0; i < 1 << 16; i++) text += "ab\n"[rand() % 3];
+  Regen::Options option;
+  option.partial_match(true);
+  Regen plain(pattern, option);
+  Regen jitted(pattern, option);
+  jitted.Compile(Regen::Options::O1);
+  for (std::size_t i = 0; i + 64 <= text.size(); i += 64) {
+    Regen::StringPiece line(text.data() + i, 64), r1, r2;
+    ASSERT_EQ(plain.Match(line, &r1), jitted.Match(line, &r2));
+    ASSERT_EQ(r1.end(), r2.end());
+  }
+}
+
+TEST(StateBudgetTest, Flush) {
+  const char *pattern = "(a|b)*a(a|b){12}";
+  std::string text;
+  srand(11);
+  for (int i = 0; i < 1 << 14; i++) text += "ab"[rand() % 2];
+  Regen::Options option;
+  option.partial_match(true);
+  Regen unlimited(pattern, option);
+  option.state_budget(64);
+  Regen bounded(pattern, option);
+  Regen::StringPiece r1, r2;
+  ASSERT_EQ(unlimited.Match(text, &r1), bounded.Match(text, &r2));
+  ASSERT_EQ(r1.end(), r2.end());
+  Regen::StateStats stats = bounded.state_stats();
+  ASSERT_GE(64u, stats.states);
+  ASSERT_LT(0u, stats.flushes);
+  ASSERT_LT(64u, stats.built);
+}
+
+TEST(TierTest, StateLimit) {
+  /* the anchor keeps it off the bit-parallel NFA. */
+  const char *pattern = "(a|b)*b(a|b){10}$";
+  const std::string text = "abbbababbabaabababbba";
+  Regen::Options option;
+  option.partial_match(true);
+  Regen lazy(pattern, option);
+  ASSERT_EQ(Regen::LazyDFA, lazy.tier());
+  ASSERT_FALSE(lazy.Compile(Regen::Options::O1));
+  ASSERT_EQ(Regen::LazyDFA, lazy.tier());
+  option.state_limit(1 << 14);
+  Regen full(pattern, option);
+  ASSERT_TRUE(full.Compile(Regen::Options::O1));
+  ASSERT_EQ(Regen::FullDFA, full.tier());
+  Regen::StringPiece r1, r2;
+  ASSERT_TRUE(lazy.Match(text, &r1));
+  ASSERT_TRUE(full.Match(text, &r2));
+  ASSERT_EQ(r1.end(), r2.end());
+  /* built from scratch, it stops at the first match as well. */
+  const std::string lines = "yccy\ncccb\n\nxbccc";
+  option.state_limit(Regen::Options::DefaultStateLimit);
+  Regen scratch("ccc", option);
+  ASSERT_EQ(Regen::LazyDFA, scratch.tier());
+  ASSERT_TRUE(scratch.Match(lines, &r1));
+  ASSERT_EQ(lines.data() + 8, r1.end());
+  /* sets are held to the limit as well. */
+  option.state_limit(2);
+  RegenSet set(option);
+  set.Add("ccc");
+  set.Add("xb");
+  ASSERT_FALSE(set.Compile(Regen::Options::O1));
+  std::vector<std::size_t> ids;
+  ASSERT_TRUE(set.Match(lines, &ids));
+  ASSERT_EQ(2u, ids.size());
+  option.state_limit(Regen::Options::DefaultStateLimit);
+  RegenSet full_set(option);
+  full_set.Add("ccc");
+  full_set.Add("xb");
+  ASSERT_TRUE(full_set.Compile(Regen::Options::O1));
+  ASSERT_TRUE(full_set.Match(lines, &ids));
+  ASSERT_EQ(2u, ids.size());
+}
+
+TEST(TierTest, BitParallelNFA) {
+  const char *pattern = "(a|b)*a(a|b){12}";
+  const std::string text = "bbabbbabababbaabbbabbbb\nabababbabaabbbbababbbaa";
+  Regen::Options option;
+  option.partial_match(true);
+  Regen lazy(pattern, option), bitnfa(pattern, option);
+  ASSERT_TRUE(bitnfa.Compile(Regen::Options::O1));
+  ASSERT_EQ(Regen::BitParallelNFA, bitnfa.tier());
+  for (std::size_t i = 0; i <= text.size(); i++) {
+    Regen::StringPiece string(text.data(), i), r1, r2;
+    ASSERT_EQ(lazy.Match(string, &r1), bitnfa.Match(string, &r2));
+    ASSERT_EQ(r1.end(), r2.end());
+  }
+  option.shortest_match(true);
+  Regen shortest(pattern, option);
+  shortest.Compile(Regen::Options::O1);
+  Regen::StringPiece r;
+  ASSERT_TRUE(shortest.Match(text, &r));
+  ASSERT_EQ(text.data() + 15, r.end());
+}
+
+TEST(TierTest, BoundedRepetition) {
+  Regen counted("(a?){256}a{256}");
+  ASSERT_TRUE(counted.Compile(Regen::Options::O1));
+  ASSERT_EQ(Regen::BitParallelNFA, counted.tier());
+  ASSERT_FALSE(counted.Match(std::string(255, 'a')));
+  ASSERT_TRUE(counted.Match(std::string(256, 'a')));
+  ASSERT_TRUE(counted.Match(std::string(512, 'a')));
+  ASSERT_FALSE(counted.Match(std::string(513, 'a')));
+  std::string text;
+  for (std::size_t i = 0; i < 300; i++) {
+    text += i % 37 == 36 ? 'c' : i % 53 == 52 ? '\n' : "ab"[i * 7 % 3 / 2];
+  }
+  Regen::Options option;
+  option.partial_match(true);
+  Regen lazy("a[^c]{20,80}c", option), bitnfa("a[^c]{20,80}c", option);
+  ASSERT_TRUE(bitnfa.Compile(Regen::Options::O1));
+  ASSERT_EQ(Regen::BitParallelNFA, bitnfa.tier());
+  for (std::size_t i = 0; i <= text.size(); i++) {
+    Regen::StringPiece string(text.data(), i), r1, r2;
+    ASSERT_EQ(lazy.Match(string, &r1), bitnfa.Match(string, &r2));
+    ASSERT_EQ(r1.end(), r2.end());
+  }
+  ASSERT_TRUE(bitnfa.Match(text));
+}
@@ -0,0 +1,126 @@
+#ifdef REGEN_ENABLE_PARALLEL
+#include "workerpool.h"
+#include <boost/bind.hpp>
+
+namespace regen {
+
+WorkerPool::WorkerPool(std::size_t thread_num):
+    ranges_(new TaskRange[thread_num == 0 ? 1 : thread_num]),
+    task_(NULL), arg_(NULL), task_num_(0), done_task_(0), running_(0),
+    generation_(0), shutdown_(false)
+{
+  for (std::size_t i = 1; i < thread_num; i++) {
+    workers_.push_back(new boost::thread(boost::bind(&WorkerPool::Work, this, i)));
+  }
+}
+
+WorkerPool::~WorkerPool()
+{
+  {
+    boost::unique_lock<boost::mutex> lock(mutex_);
+    shutdown_ = true;
+  }
+  wakeup_.notify_all();
+  for (std::vector<boost::thread *>::iterator i = workers_.begin(); i != workers_.end(); ++i) {
+    (*i)->join();
+    delete *i;
+  }
+  delete[] ranges_;
+}
+
+/* take the next task of own range. */
+bool WorkerPool::Claim(std::size_t worker_id, std::size_t *task_id)
+{
+  TaskRange &range = ranges_[worker_id];
+  boost::lock_guard<boost::mutex> lock(range.mutex);
+  if (range.begin == range.end) return false;
+  *task_id = range.begin++;
+  return true;
+}
+
+/* move the latter half of the largest other range into own (empty) range. */
+bool WorkerPool::Steal(std::size_t worker_id)
+{
+  const std::size_t thread_num = this->thread_num();
+  for (;;) {
+    std::size_t victim = worker_id, remain = 0;
+    for (std::size_t i = 1; i < thread_num; i++) {
+      std::size_t v = (worker_id + i) % thread_num;
+      boost::lock_guard<boost::mutex> lock(ranges_[v].mutex);
+      if (ranges_[v].end - ranges_[v].begin > remain) {
+        victim = v;
+        remain = ranges_[v].end - ranges_[v].begin;
+      }
+    }
+    if (victim == worker_id) return false;
+    std::size_t begin, end;
+    {
+      boost::lock_guard<boost::mutex> lock(ranges_[victim].mutex);
+      remain = ranges_[victim].end - ranges_[victim].begin;
+      if (remain == 0) continue; // lost the race, look again.
+      end = ranges_[victim].end;
+      begin = end - (remain + 1) / 2;
+      ranges_[victim].end = begin;
+    }
+    boost::lock_guard<boost::mutex> lock(ranges_[worker_id].mutex);
+    ranges_[worker_id].begin = begin;
+    ranges_[worker_id].end = end;
+    return true;
+  }
+}
+
+void WorkerPool::Dispatch(std::size_t worker_id)
+{
+  std::size_t task_id, done = 0;
+  while (Claim(worker_id, &task_id) || (Steal(worker_id) && Claim(worker_id, &task_id))) {
+    task_(arg_, task_id, worker_id);
+    done++;
+  }
+  boost::lock_guard<boost::mutex> lock(mutex_);
+  done_task_ += done;
+  running_--;
+  if (done_task_ == task_num_ && running_ == 0) finish_.notify_all();
+}
+
+void WorkerPool::Work(std::size_t worker_id)
+{
+  std::size_t generation = 0;
+  for (;;) {
+    {
+      boost::unique_lock<boost::mutex> lock(mutex_);
+      while (!shutdown_ && generation == generation_) wakeup_.wait(lock);
+      if (shutdown_) return;
+      generation = generation_;
+      running_++;
+    }
+    Dispatch(worker_id);
+  }
+}
+
+void WorkerPool::Run(Task task, void *arg, std::size_t task_num)
+{
+  if (task_num == 0) return;
+  boost::lock_guard<boost::mutex> run_lock(run_mutex_);
+  const std::size_t thread_num = this->thread_num();
+  {
+    boost::unique_lock<boost::mutex> lock(mutex_);
+    task_ = task;
+    arg_ = arg;
+    task_num_ = task_num;
+    done_task_ = 0;
+    running_++;
+    for (std::size_t i = 0; i < thread_num; i++) {
+      boost::lock_guard<boost::mutex> range_lock(ranges_[i].mutex);
+      ranges_[i].begin = task_num * i / thread_num;
+      ranges_[i].end = task_num * (i + 1) / thread_num;
+    }
+    generation_++;
+  }
+  if (!workers_.empty() && task_num > 1) wakeup_.notify_all();
+  Dispatch(0);
+  boost::unique_lock<boost::mutex> lock(mutex_);
+  while (done_task_ != task_num_ || running_ != 0) finish_.wait(lock);
+}
+
+} // namespace regen
+#endif // REGEN_ENABLE_PARALLEL
@@ -0,0 +1,50 @@
+#ifndef REGEN_WORKERPOOL_H_
+#define  REGEN_WORKERPOOL_H_
+#ifdef REGEN_ENABLE_PARALLEL
+#include "util.h"
+#include <boost/thread.hpp>
+
+namespace regen {
+
+/* Long-lived worker threads which run batches of indexed tasks.
+ * Run() blocks until every task of the batch has finished. the calling
+ * thread takes part in the batch, so a pool for N threads keeps N-1 workers.
+ * each thread starts on its own contiguous range of task ids, and steals
+ * the latter half of another range when its own runs out, so a slow
+ * thread does not hold up the batch. no allocation is made per batch. */
+class WorkerPool {
+public:
+  typedef void (*Task)(void *arg, std::size_t task_id, std::size_t worker_id);
+  WorkerPool(std::size_t thread_num);
+  ~WorkerPool();
+  std::size_t thread_num() const { return workers_.size() + 1; }
+  void Run(Task task, void *arg, std::size_t task_num);
+private:
+  struct TaskRange {
+    boost::mutex mutex;
+    std::size_t begin;
+    std::size_t end;
+  };
+  void Work(std::size_t worker_id);
+  void Dispatch(std::size_t worker_id);
+  bool Claim(std::size_t worker_id, std::size_t *task_id);
+  bool Steal(std::size_t worker_id);
+  boost::mutex run_mutex_;
+  boost::mutex mutex_;
+  boost::condition_variable wakeup_;
+  boost::condition_variable finish_;
+  std::vector<boost::thread *> workers_;
+  TaskRange *ranges_;
+  Task task_;
+  void *arg_;
+  std::size_t task_num_;
+  std::size_t done_task_;
+  std::size_t running_;
+  std::size_t generation_;
+  bool shutdown_;
+  DISALLOW_COPY_AND_ASSIGN(WorkerPool);
+};
+
+} // namespace regen
+#endif // REGEN_ENABLE_PARALLEL
+#endif // REGEN_WORKERPOOL_H_